@@ -6,6 +6,33 @@
 
 #include <iostream>
 
+/**
+ * The window of candidates a keypoint is compared with during matching:
+ * - ANGLE: the keypoints whose orientation is close to the keypoint's one ;
+ * - NORM: the keypoints whose descriptor's norm is close to the keypoint's one ;
+ * - GRID: the keypoints close to the keypoint both by orientation and by descriptor's norm,
+ *   and optionally by octave, found through a grid of buckets.
+ */
+enum class MatchingWindow {
+    ANGLE,
+    NORM,
+    GRID
+};
+
+/**
+ * The copy of the descriptors the matching windows are scanned with:
+ * - FLOAT: the descriptors themselves ;
+ * - HALF: half-precision floats ;
+ * - INT8: 8-bit integers, each component having its own scale.
+ * Compact copies are smaller to read, and the candidates they can't rule out
+ * are scored again with the float descriptors.
+ */
+enum class DescriptorStorage {
+    FLOAT,
+    HALF,
+    INT8
+};
+
 struct DetectorOptions {
     std::string image;
     std::string rawName;
@@ -13,9 +40,26 @@ struct DetectorOptions {
     std::string mask;
 
     int kp_hessian;
+    int kp_tile;
+    int kp_tileMargin;
 
     double g2NN_angleThreshold;
     double g2NN_normThreshold;
+    int g2NN_octaveThreshold;
+    double g2NN_separation;
+    int g2NN_budget;
+    int g2NN_cap;
+    MatchingWindow g2NN_window;
+    int g2NN_batch;
+    bool g2NN_symmetric;
+    bool g2NN_ann;
+    int g2NN_annTrees;
+    int g2NN_annChecks;
+    bool g2NN_annRecall;
+    std::string g2NN_spill;
+    DescriptorStorage g2NN_storage;
+    int g2NN_pca;
+    std::string g2NN_pcaFile;
 
     double length;
 
@@ -36,5 +80,6 @@ struct DetectorOptions {
     bool before_dilation;
 
     int jobs;
+    int workers;
 };
 
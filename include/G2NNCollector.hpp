@@ -0,0 +1,144 @@
+#pragma once
+
+#include <limits>
+
+namespace defals {
+    /**
+     * This class collects the candidates of a keypoint for the g2NN ratio test.
+     *
+     * The ratio test walks the candidates by ascending distance \f$d_1 \leq d_2 \leq ...\f$
+     * and accepts \f$d_k\f$ as long as \f$d_k / d_{k+1} < 0.5\f$. The collector is fed with
+     * squared distances, so it checks \f$d_k^2 / d_{k+1}^2 < 0.25\f$ instead and no square
+     * root is ever computed.
+     *
+     * Once a pair fails the test, no candidate further than the second element of that pair
+     * can change the result. The collector only keeps the candidates the test can still reach,
+     * in a small sorted array living on the stack: no allocation is made while matching.
+     *
+     * Candidates at equal distances are all kept and ordered by index.
+     *
+     * Note: at most CAPACITY - 1 matches can be accepted for one keypoint.
+     */
+    class G2NNCollector {
+    public:
+        /**  The maximal number of candidates kept  */
+        static constexpr int CAPACITY = 16;
+        /**  The g2NN ratio threshold  */
+        static constexpr float RATIO = 0.5f;
+        /**  The g2NN ratio threshold on squared distances  */
+        static constexpr float SQUARED_RATIO = RATIO * RATIO;
+
+        /*
+         * +================+
+         * |  CONSTRUCTORS  |
+         * +================+
+         */
+        G2NNCollector() : _size(0), _closed(false) {
+        }
+
+        /*
+         * +=============+
+         * |  ALGORITHM  |
+         * +=============+
+         */
+
+        /**
+         * Adds a candidate, then drops every candidate the ratio test can't reach anymore.
+         *
+         * @param distance  The squared distance between the keypoint and the candidate.
+         * @param index     The index of the candidate.
+         */
+        inline void push(float distance, int index) {
+            if (distance >= bound())
+                return;
+
+            int k = _size < CAPACITY ? _size : CAPACITY - 1;
+            while (k > 0 && (distance < _distances[k - 1] ||
+                             (distance == _distances[k - 1] && index < _indices[k - 1]))) {
+                _distances[k] = _distances[k - 1];
+                _indices[k] = _indices[k - 1];
+                k--;
+            }
+            _distances[k] = distance;
+            _indices[k] = index;
+            if (_size < CAPACITY)
+                _size++;
+
+            truncate();
+        }
+
+        /**
+         * @return  The squared distance from which a candidate can't change the result of the ratio
+         *          test anymore. Candidates at least this far can be skipped.
+         */
+        inline float bound() const {
+            return _closed ? _distances[_size - 1] : std::numeric_limits<float>::infinity();
+        }
+
+        /**
+         * @return  The number of candidates accepted by the ratio test. They are the first ones.
+         */
+        inline int nbMatches() const {
+            int k = 0;
+            while (k + 1 < _size && _distances[k] / _distances[k + 1] < SQUARED_RATIO)
+                k++;
+
+            return k;
+        }
+
+        /*
+         * +===================+
+         * |  GETTERS/SETTERS  |
+         * +===================+
+         */
+        inline int size() const {
+            return _size;
+        }
+
+        inline float distance(int k) const {
+            return _distances[k];
+        }
+
+        inline int index(int k) const {
+            return _indices[k];
+        }
+
+        /**
+         * Adds the candidates of another collector of the same keypoint.
+         *
+         * @param other     The collector to merge.
+         */
+        inline void merge(const G2NNCollector& other) {
+            for (int k = 0; k < other._size; k++)
+                push(other._distances[k], other._indices[k]);
+        }
+
+        inline void clear() {
+            _size = 0;
+            _closed = false;
+        }
+
+    private:
+        /**
+         * Drops the candidates following the first pair failing the ratio test.
+         */
+        inline void truncate() {
+            int k = 0;
+            while (k + 1 < _size && _distances[k] / _distances[k + 1] < SQUARED_RATIO)
+                k++;
+
+            if (k + 1 < _size)
+                _size = k + 2;
+            _closed = k + 1 < _size || _size == CAPACITY;
+        }
+
+        /**  The squared distances of the candidates, sorted  */
+        float _distances[CAPACITY];
+        /**  The indices of the candidates  */
+        int _indices[CAPACITY];
+        /**  The number of candidates  */
+        int _size;
+        /**  True if a farther candidate can't change the result anymore  */
+        bool _closed;
+    };
+}
@@ -27,6 +27,8 @@ namespace defals {
 
         InterestPoint(const cv::KeyPoint &keypoint, const cv::Mat &descriptor);
 
+        InterestPoint(const cv::KeyPoint &keypoint, const cv::Mat &descriptor, float norm);
+
         InterestPoint(const cv::Point2f& point);
 
         /*
@@ -35,6 +37,7 @@ namespace defals {
          * +===================+
          */
         const cv::Mat &getDescriptor() const;
+        float getNorm() const;
 
         int getAngleIdx() const;
         void setAngleIdx(int angleIdx);
@@ -91,6 +94,8 @@ namespace defals {
     private:
         /**  A 1x64 or 1x128 vector standing for the descriptor of the keypoint */
         cv::Mat _descriptor;
+        /**  The euclidean norm of _descriptor, computed once  */
+        float _norm;
 
         /**  The index of the keypoint in the angle-sorted list */
         int _angleIdx;
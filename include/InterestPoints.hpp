@@ -4,26 +4,84 @@
 
 #pragma once
 
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <cmath>
+
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d.hpp>
 #include <opencv2/xfeatures2d/nonfree.hpp>
+#include <opencv2/flann.hpp>
 
 #include "InterestPoint.hpp"
+#include "G2NNCollector.hpp"
+#include "distance.hpp"
+#include "DetectorOptions.hpp"
+#include "MappedFile.hpp"
 
 namespace defals {
     /**
-     * This class is a wrapper for an InterestPoint vector.
+     * A window in the angle order, made of at most two ranges [first, second] of indices.
+     *
+     * Angles live on a circle: the window of a keypoint whose angle is close to 0° also holds
+     * the keypoints close to 360°, which lie at the other end of the angle order. Such a window
+     * is split in two ranges, the main one containing the keypoint itself.
+     */
+    struct AngleWindow {
+        /**  The ranges of the window, only the first _nbRanges_ ones are meaningful  */
+        std::pair<int, int> ranges[2];
+        /**  The number of non-empty ranges  */
+        int nbRanges = 0;
+
+        /**
+         * Adds the range [_first_, _last_] to the window, unless it is empty.
+         */
+        inline void add(int first, int last) {
+            if (first <= last)
+                ranges[nbRanges++] = std::make_pair(first, last);
+        }
+
+        /**
+         * @return  The number of keypoints in the window.
+         */
+        inline int size() const {
+            int count = 0;
+            for (int r = 0; r < nbRanges; r++)
+                count += ranges[r].second - ranges[r].first + 1;
+
+            return count;
+        }
+    };
+
+    /**
+     * This class stores a set of keypoints and their descriptors.
      *
-     * Given a cv::KeyPoint vector, it handles two vectors :
-     * - a vector of pointers to the keypoints, sorted by their angle value ;
-     * - a vector of pointers to the keypoints, sorted by the norm of their descriptor value.
-     * It is important to note that we don't duplicate points: each vector contains the exact same points
-     * that have been passed to the constructor, but sorted in a different order.
+     * Given a cv::KeyPoint vector, the keypoints are sorted by their angle value and stored
+     * as a structure of arrays:
+     * - one continuous N x 64 (or N x 128) float matrix holding the descriptors ;
+     * - flat arrays holding the angle, descriptor norm, position and size of each keypoint ;
+     * - the permutation sorting the keypoints by the norm of their descriptor, and its inverse ;
+     * - optionally, a grid of buckets over the angle, the norm and the octave of the keypoints ;
+     * - optionally, an approximate nearest neighbours index over the descriptors ;
+     * - optionally, a compact copy of the descriptors, as half-precision floats or 8-bit integers ;
+     * - optionally, the projection of the descriptors on their first principal components.
+     * Keypoints are then accessed through their index instead of through InterestPoint objects,
+     * which keeps the matching algorithm on contiguous memory and avoids copying keypoints around.
      *
-     * Note: unless specified otherwise, the i-th keypoint is the i-th keypoint of the angles vector.
+     * Note: unless specified otherwise, the i-th keypoint is the i-th keypoint in the angle order.
      */
     class InterestPoints {
     public:
+        /**  The relative error allowed for float rounding when ruling out a candidate from its compact descriptor  */
+        static constexpr float COMPACT_MARGIN = 1e-4f;
+        /**  The maximal number of descriptors the principal components are learnt from  */
+        static constexpr int PCA_SAMPLES = 10000;
+        /**  The maximal number of candidates of a keypoint handed to the distance kernels at once  */
+        static const int CANDIDATE_BLOCK = 64;
+        /**  The number of spilled descriptors written or read before they're given back to the system  */
+        static const int SPILL_CHUNK = 4096;
+
         /*
          * +================+
          * |  CONSTRUCTORS  |
@@ -34,64 +92,192 @@ namespace defals {
         InterestPoints(const std::vector <cv::KeyPoint> &keypoints,
                        const cv::Mat &descriptors,
                        double angleThreshold,
-                       double normThreshold);
-
-        /*
-         * +=============+
-         * |  ITERATORS  |
-         * +=============+
-         */
-        std::vector<std::shared_ptr<InterestPoint>>::iterator begin();
-        std::vector<std::shared_ptr<InterestPoint>>::iterator end();
-
-        std::vector<std::shared_ptr<InterestPoint>>::const_iterator begin() const;
-        std::vector<std::shared_ptr<InterestPoint>>::const_iterator end() const;
+                       double normThreshold,
+                       int jobs = 1,
+                       const std::string &spillDirectory = "",
+                       const MappedFile *source = nullptr);
 
         /*
          * +===================+
          * |  GETTERS/SETTERS  |
          * +===================+
          */
-        const cv::Mat &getDescriptor(int i) const;
-        cv::Mat getDescriptors() const;
+        const float *descriptor(int i) const;
+        cv::Mat getDescriptor(int i) const;
+        const cv::Mat &getDescriptors() const;
+        int descriptorSize() const;
+
+        float angle(int i) const;
+        float descriptorNorm(int i) const;
+        cv::Point2f pt(int i) const;
+        int octave(int i) const;
+        float response(int i) const;
+        float keypointSize(int i) const;
+
+        int normIdx(int i) const;
+        int atNorm(int k) const;
 
         std::vector <cv::KeyPoint> asKeyPoints() const;
 
-        const cv::Point2f &pt(int i) const;
-        const InterestPoint &get(int i) const;
-        const InterestPoint &operator[](int i) const;
+        InterestPoint get(int i) const;
+        InterestPoint operator[](int i) const;
 
         int size() const;
 
+        void setMinSeparation(double separation);
+        void setCandidateCap(int cap);
+        void setNormWindow(double window);
+
+        double angleThreshold() const;
+        double normThreshold() const;
+        double normWindow() const;
+
+        bool spilled() const;
+        DescriptorStorage storage() const;
+        int projectionSize() const;
+
+        static long long avoidedDistances();
+        static long long blockAvoidedDistances();
+        static void resetAvoidedDistances();
+
         /*
          * +=============+
          * |  ALGORITHM  |
          * +=============+
          */
 
-        std::pair<int, int> getRangeAngle(const InterestPoint &pt) const;
-        std::pair<int, int> getRangeNorm(const InterestPoint &pt) const;
-        std::pair<int, int> getRelativeRangeNorm(const InterestPoint& center, const InterestPoint& end) const;
+        AngleWindow getRangeAngle(int i) const;
+        AngleWindow getUncappedRangeAngle(int i) const;
+        std::pair<int, int> getRangeNorm(int i) const;
+        std::pair<int, int> getRelativeRangeNorm(int center, int end) const;
+
+        void similarityAngle(int i, G2NNCollector &candidates, int minIdx = 0, int maxIdx = -1) const;
+        void similarityNorm(int i, G2NNCollector &candidates, int minIdx = 0, int maxIdx = -1) const;
+        void similarityAngleBlock(int first, int last, std::vector<G2NNCollector> &candidates) const;
+        void similaritySymmetric(int first, int last,
+                                 std::vector<G2NNCollector> &band, std::vector<G2NNCollector> &head) const;
 
-        std::map<double, InterestPoint> similarityAngle(const InterestPoint& pt, int minIdx = 0, int maxIdx = -1) const;
-        std::map<double, InterestPoint> similarityNorm(const InterestPoint& pt, int minIdx = 0, int maxIdx = -1) const;
+        void buildGrid(int octaveThreshold = -1);
+        int similarityGrid(int i, G2NNCollector &candidates) const;
 
-        void sort();
+        void buildIndex(int trees);
+        int similarityIndex(int i, G2NNCollector &candidates, MatchingWindow window, int checks) const;
 
+        bool inWindow(int i, int j, MatchingWindow window) const;
+
+        void buildCompactDescriptors(DescriptorStorage storage);
+        void learnProjection(int dimensions);
+        void loadProjection(const std::string &path);
+
+        double tuneAngleThreshold(int budget, int samples);
+        double tuneNormWindow(int budget, int samples);
+        std::vector<int> sampleWindowSizes(MatchingWindow window, int samples) const;
+
+        void pageWindow(int first, int last) const;
+        void releaseBefore(int i) const;
 
     private:
-        std::pair<int, int> getRange(const std::vector<std::shared_ptr<InterestPoint>> &pts,
-                                     int i,
-                                     double (comp)(const InterestPoint &, const InterestPoint &),
-                                     double threshold) const;
-
-        /**  Pointers to the keypoints sorted by angles  */
-        std::vector<std::shared_ptr<InterestPoint>> _pointsSortedAngle;
-        /**  Pointers to the keypoints sorted by norms of their descriptors */
-        std::vector<std::shared_ptr<InterestPoint>> _pointsSortedNorm;
+        void sort(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors, int jobs,
+                  const std::string &spillDirectory, const MappedFile *source);
+        void evictRows(int first, int last) const;
+        void project(const cv::Mat &components);
+
+        /**
+         * @return  True if the i-th and j-th keypoints are far enough from each other to be compared.
+         */
+        inline bool separated(int i, int j) const {
+            float dx = _x[i] - _x[j];
+            float dy = _y[i] - _y[j];
+            return dx * dx + dy * dy >= _squaredSeparation;
+        }
+
+        int reachableRows(int i, int *rows, float *bounds, int count) const;
+        void collectRows(int i, int *rows, int count, G2NNCollector &candidates) const;
+
+        std::pair<int, int> getSortedRange(const std::vector<float> &keys, int i, double threshold) const;
+        std::pair<int, int> mainRange(int i) const;
+        float walkAngles(int i, int count, double threshold, int &left, int &right) const;
+        AngleWindow circularWindow(int i, int left, int right) const;
+
+        int angleCell(float angle) const;
+        int normCell(float norm) const;
+        int gridCell(int angleCell, int normCell, int octaveCell) const;
+
+        /**  The descriptors, one per row, in the angle order  */
+        cv::Mat _descriptors;
+        /**  The file holding the descriptors when they're spilled out of memory  */
+        std::shared_ptr<MappedFile> _spill;
+        /**  The keypoints' angles, sorted  */
+        std::vector<float> _angles;
+        /**  The norms of the keypoints' descriptors, computed once at construction  */
+        std::vector<float> _norms;
+        /**  The norms of the keypoints' descriptors, sorted  */
+        std::vector<float> _sortedNorms;
+        /**  The keypoints' abscissas  */
+        std::vector<float> _x;
+        /**  The keypoints' ordinates  */
+        std::vector<float> _y;
+        /**  The keypoints' diameters  */
+        std::vector<float> _sizes;
+        /**  The octaves the keypoints were detected in  */
+        std::vector<int> _octaves;
+        /**  The detector's responses at the keypoints  */
+        std::vector<float> _responses;
+        /**  _normOrder[k] is the index of the k-th keypoint in the norm order  */
+        std::vector<int> _normOrder;
+        /**  _normIdx[i] is the position of the i-th keypoint in the norm order  */
+        std::vector<int> _normIdx;
         /**  The threshold for the computation of the window in the angles vector  */
         double _angleThreshold;
-        /**  The threshold for the computation of the window in the norms vector  */
+        /**  The highest norm of a candidate, and the threshold of the grid window along the norms  */
         double _normThreshold;
+        /**  The half-width of the window in the norms vector, the norm threshold unless it was tuned  */
+        double _normWindow;
+        /**  The square of the minimal distance in pixels between two compared keypoints  */
+        float _squaredSeparation = 0;
+        /**  The maximal number of keypoints in an angle window, 0 for no limit  */
+        int _candidateCap = 0;
+
+        /**  The maximal octave difference in the grid window, -1 if octaves are ignored  */
+        int _octaveThreshold = -1;
+        /**  The number of cells of the grid along the angle, norm and octave axes  */
+        int _gridAngles = 0, _gridNorms = 0, _gridOctaves = 0;
+        /**  The width of a cell along the angle and norm axes  */
+        float _cellAngle = 0, _cellNorm = 0;
+        /**  The lowest norm and octave, at the origin of the grid  */
+        float _minNorm = 0;
+        int _minOctave = 0;
+        /**  The keypoints of cell c are _cellPoints[_cellStart[c]] to _cellPoints[_cellStart[c + 1] - 1]  */
+        std::vector<int> _cellStart;
+        /**  The keypoints sorted by cell, by increasing index within a cell  */
+        std::vector<int> _cellPoints;
+
+        /**  The approximate nearest neighbours index over the descriptors  */
+        cv::Ptr<cv::flann::Index> _index;
+        /**  Serializes the searches of the index, which keeps per-query state and isn't thread-safe  */
+        std::shared_ptr<std::mutex> _indexLock;
+
+        /**  The copy of the descriptors scanned by the windows  */
+        DescriptorStorage _storage = DescriptorStorage::FLOAT;
+        /**  The descriptors as half-precision floats, one row per keypoint, in the angle order  */
+        std::vector<uint16_t> _halfDescriptors;
+        /**  The descriptors as 8-bit integers, one row per keypoint, in the angle order  */
+        std::vector<int8_t> _int8Descriptors;
+        /**  The scale of each component of the 8-bit descriptors  */
+        std::vector<float> _scales;
+        /**  _errors[i] bounds the euclidean distance between the i-th compact descriptor and the float one  */
+        std::vector<float> _errors;
+
+        /**  The number of principal components the descriptors are projected on, 0 for none  */
+        int _projectionSize = 0;
+        /**  The projections of the descriptors, one row per keypoint, in the angle order  */
+        std::vector<float> _projections;
+        /**  Bounds the rounding error of the distance between two projections  */
+        float _projectionSlack = 0;
+
+        /**  The number of distances ruled out by the projections or the compact descriptors in this thread  */
+        static thread_local long long _avoided;
+        /**  The number of distances ruled out by the matrix products of blocked matching in this thread  */
+        static thread_local long long _blockAvoided;
     };
 }
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+namespace defals {
+    /**
+     * This class is a temporary file mapped in memory, used to keep large arrays out of the RAM.
+     *
+     * The file is created in a given directory and removed from it right away: it only lives
+     * as long as the mapping. Its pages are loaded by the system when they're accessed, and can
+     * be given back with MappedFile::release once they aren't needed anymore, or with
+     * MappedFile::evict while the file is being filled.
+     */
+    class MappedFile {
+    public:
+        /*
+         * +================+
+         * |  CONSTRUCTORS  |
+         * +================+
+         */
+        MappedFile(const std::string &directory, size_t size);
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile();
+
+        /*
+         * +=============+
+         * |  ALGORITHM  |
+         * +=============+
+         */
+        void flush() const;
+
+        void prefetch(size_t from, size_t to) const;
+
+        void release(size_t from, size_t to);
+
+        void evict(size_t from, size_t to) const;
+
+        void read(size_t offset, void *buffer, size_t size) const;
+
+        /*
+         * +===================+
+         * |  GETTERS/SETTERS  |
+         * +===================+
+         */
+        void *data() const;
+        size_t size() const;
+
+    private:
+        /**  The mapped memory  */
+        void *_data;
+        /**  The size of the file in bytes  */
+        size_t _size;
+        /**  The file descriptor of the file  */
+        int _fd;
+        /**  The bytes before this offset have already been released  */
+        std::atomic<size_t> _released;
+    };
+}
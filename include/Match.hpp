@@ -0,0 +1,42 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+
+namespace defals {
+    /**
+     * This structure is a match between the i-th and the j-th keypoints,
+     * along with the squared distance between their descriptors.
+     *
+     * A match found from both of its keypoints is recorded twice, once in each direction:
+     * canonical matches have _i_ < _j_, so that both records end up next to each other
+     * once sorted and one of them can be dropped.
+     */
+    struct Match {
+        int i;
+        int j;
+        float distance;
+
+        Match(int i, int j, float distance) : i(i), j(j), distance(distance) {
+        }
+
+        /**
+         * Orders the keypoints of the match so that _i_ < _j_.
+         */
+        inline void canonicalize() {
+            if (j < i)
+                std::swap(i, j);
+        }
+
+        inline bool operator<(const Match& other) const {
+            return std::tie(i, j, distance) < std::tie(other.i, other.j, other.distance);
+        }
+
+        /**
+         * @return  True if both matches are between the same keypoints.
+         */
+        inline bool samePair(const Match& other) const {
+            return i == other.i && j == other.j;
+        }
+    };
+}
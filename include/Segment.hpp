@@ -0,0 +1,42 @@
+#pragma once
+
+#include <type_traits>
+
+#include <opencv2/opencv.hpp>
+
+namespace defals {
+    /**
+     * This structure is a segment between two matched keypoints, as read by the clustering:
+     * its end points, its polar angle and its length, along with the indices of the keypoints.
+     *
+     * It is a plain 32-byte record, copied as raw memory: segments are stored in a contiguous
+     * array, and clusters refer to them by their index in it. The other representations of the
+     * segment (cartesian equation, orthogonal projection of the origin...) are only computed by
+     * a Line built from the segment, when they're needed for drawing.
+     */
+    struct Segment {
+        /**  The start point, the closest end to the origin in lexicographic order  */
+        float x1, y1;
+        /**  The end point  */
+        float x2, y2;
+        /**  The polar angle of the line, as given by Line::getTheta  */
+        float theta;
+        /**  The distance between both ends  */
+        float length;
+        /**  The indices of the start and end keypoints in the angle order, -1 if there are none  */
+        int point1, point2;
+
+        static Segment between(const cv::Point2f &start, const cv::Point2f &end, int point1 = -1, int point2 = -1);
+
+        inline cv::Point2f start() const {
+            return cv::Point2f(x1, y1);
+        }
+
+        inline cv::Point2f end() const {
+            return cv::Point2f(x2, y2);
+        }
+    };
+
+    static_assert(sizeof(Segment) == 32, "a Segment should fill half a cache line");
+    static_assert(std::is_trivially_copyable<Segment>::value, "a Segment should be copied as raw memory");
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+
+#include <sys/types.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "InterestPoints.hpp"
+#include "Match.hpp"
+
+namespace defals {
+    /**
+     * This structure is a part of the keypoints sent to a worker process for matching.
+     *
+     * A shard owns a range of the angle order: the worker computes the matches of these
+     * keypoints only. It also holds a halo, that is every other keypoint belonging to the
+     * angle window of an owned keypoint, including those found by going around 360°,
+     * so that the worker sees the same windows as a single process would.
+     *
+     * Workers are started before any keypoint is computed: the shard also carries the
+     * thresholds of the windows, which may have been tuned on all the keypoints.
+     */
+    struct Shard {
+        /**  The indices in the angle order of the keypoints of the shard, sorted  */
+        std::vector<int> indices;
+        /**  The owned keypoints are indices[ownedFirst] to indices[ownedLast - 1]  */
+        int ownedFirst = 0;
+        int ownedLast = 0;
+        /**  The angle threshold of the windows  */
+        double angleThreshold = 0;
+        /**  The half-width of the norm windows  */
+        double normWindow = 0;
+    };
+
+    /**
+     * This structure is a worker process waiting for its shard.
+     */
+    struct Worker {
+        /**  The process ID of the worker  */
+        pid_t pid;
+        /**  The pipe the shard is written to  */
+        int shardPipe;
+        /**  The pipe the matches are read from  */
+        int matchesPipe;
+    };
+
+    Shard makeShard(const InterestPoints &points, int first, int last, MatchingWindow window);
+
+    void writeShard(int fd, const InterestPoints &points, const Shard &shard);
+
+    bool readShard(int fd, Shard &shard, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors);
+
+    void writeMatches(int fd, const std::vector<Match> &matches);
+
+    bool readMatches(int fd, std::vector<Match> &matches);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+
+namespace defals {
+    /**
+     * This class hands out the indices [first, last[ to several threads, chunk by chunk.
+     *
+     * Threads take their next chunk from a shared atomic counter as soon as they are done
+     * with the previous one, so that a thread falling on expensive indices doesn't hold the
+     * others back, and every index is given exactly once.
+     *
+     * The size of the chunks is chosen by each thread from the time its last chunk took:
+     * chunks should last about TARGET_SECONDS, and never exceed half of the remaining indices
+     * divided among the threads, so that the last chunks get smaller and the threads finish together.
+     */
+    class WorkQueue {
+    public:
+        /**  The time a chunk should take  */
+        static constexpr double TARGET_SECONDS = 0.005;
+
+        /*
+         * +================+
+         * |  CONSTRUCTORS  |
+         * +================+
+         */
+        WorkQueue(int first, int last, int nbThreads, int granularity = 1);
+
+        /*
+         * +=============+
+         * |  ALGORITHM  |
+         * +=============+
+         */
+        bool take(int count, int &first, int &last);
+
+        int chunkSize(int count, double seconds) const;
+
+        /*
+         * +===================+
+         * |  GETTERS/SETTERS  |
+         * +===================+
+         */
+        int granularity() const;
+
+    private:
+        /**  The first index that hasn't been handed out yet  */
+        std::atomic<int> _next;
+        /**  The index following the last index to hand out  */
+        int _last;
+        /**  The number of threads sharing the queue  */
+        int _nbThreads;
+        /**  Chunk sizes are multiples of this number  */
+        int _granularity;
+    };
+}
@@ -5,9 +5,15 @@
 #include <vector>
 #include <random>
 #include <thread>
+#include <atomic>
+#include <iterator>
+#include <numeric>
+#include <chrono>
+#include <mutex>
 #include <fstream>
 #include <regex>
 #include <tuple>
+#include <functional>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d.hpp>
@@ -16,20 +22,23 @@
 #include <boost/log/trivial.hpp>
 
 #include "line.hpp"
+#include "Segment.hpp"
 #include "InterestPoint.hpp"
 #include "InterestPoints.hpp"
 #include "dbscan.hpp"
-#include "ClusteredLine.hpp"
 #include "DetectorOptions.hpp"
+#include "WorkQueue.hpp"
+#include "Match.hpp"
+#include "Shard.hpp"
 
 struct DetectorOptions;
 
 namespace defals {
 
 /**
- * This will help understand the code better.
+ * This will help understand the code better: a cluster holds the indices of its segments.
  */
-    using Cluster = std::vector<Line>;
+    using Cluster = std::vector<int>;
 
 /**
  * This class represents a copy/move forgery detector.
@@ -55,13 +64,31 @@ namespace defals {
 
     private:
         void computeKeypoints();
+        void computeTiledKeypoints(std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors,
+                                   std::shared_ptr<MappedFile>& file) const;
+        void tuneWindows();
+        bool symmetricMatching() const;
         void computeMatches();
-        void computeMatch(int i);
-        friend void runMatches(copyMoveDetector &detector, int start, int end);
+        void computeMatch(int i, std::vector<Match>& matches) const;
+        friend void runMatches(copyMoveDetector &detector, WorkQueue &queue, std::vector<Match> &matches, double &busy);
 
         void computeBetterMatches();
-        void computeBetterMatch(int i);
-        friend void runBetterMatches(copyMoveDetector &detector, int start, int end);
+        void launchBetterMatches(int first, int last);
+        bool shardable() const;
+        void startWorkers();
+        void computeShardedMatches();
+        void runWorker(int input, int output);
+        void reportRecall();
+        void computeBetterMatch(int i, std::vector<Match>& matches) const;
+        void computeBetterMatchBlock(int first, int last, std::vector<Match>& matches) const;
+        void computeSymmetricChunk(int first, int last,
+                                   std::vector<G2NNCollector>& band, std::vector<G2NNCollector>& head);
+        void mergeCollectors(int first, const std::vector<G2NNCollector>& local);
+        static void addMatches(int i, const G2NNCollector& candidates, std::vector<Match>& matches, std::string& logString);
+        friend void runBetterMatches(copyMoveDetector &detector, WorkQueue &queue, int noThread,
+                                     std::vector<Match> &matches, double &busy);
+        void slideWindow(int noThread, int first, int last);
+        void mergeMatches(std::vector<std::vector<Match>>& threadMatches);
 
         void computeLines();
         void computeClusters();
@@ -92,17 +119,37 @@ namespace defals {
 
         InterestPoints _interestPoints;
 
-        std::vector<std::vector<InterestPoint>> _allMatches;
-        std::vector<Line> _lines;
+        /**  The worker processes waiting for their shard, empty if matching isn't sharded  */
+        std::vector<Worker> _workers;
+
+        /**  The canonical matches, sorted and without duplicates  */
+        std::vector<Match> _allMatches;
+
+        /**  The number of locks guarding _collectors  */
+        static const int NB_STRIPES = 64;
+        /**  _collectors[i] gathers the candidates of the i-th keypoint during symmetric matching  */
+        std::vector<G2NNCollector> _collectors;
+        /**  _collectors[i] is guarded by _stripes[i % NB_STRIPES]  */
+        std::mutex _stripes[NB_STRIPES];
+        /**  _inFlight[t] is the first keypoint of the chunk the t-th matching thread works on  */
+        std::vector<std::atomic<int>> _inFlight;
+        /**  The number of distances the matching threads didn't compute thanks to the prefilters  */
+        std::atomic<long long> _avoidedDistances;
+        /**  The number of distances the matching threads didn't compute thanks to the matrix products of blocked matching  */
+        std::atomic<long long> _blockAvoidedDistances;
+        /**  The segments between matched keypoints long enough to be clustered  */
+        std::vector<Segment> _lines;
 
         std::vector<Cluster> _clusters;
-        std::vector<Line> _outliers;
+        std::vector<int> _outliers;
 
-        std::vector<std::vector<std::pair<InterestPoint, Line>>> _hulls;
+        /**  The points of each hull, along with the point they're matched with  */
+        std::vector<std::vector<std::pair<cv::Point2f, cv::Point2f>>> _hulls;
         cv::Mat _computedMask;
         cv::Mat _extendedMask;
     };
 
-    void runMatches(copyMoveDetector &detector, int start, int end);
-    void runBetterMatches(copyMoveDetector& detector, int start, int end);
+    void runMatches(copyMoveDetector &detector, WorkQueue &queue, std::vector<Match> &matches, double &busy);
+    void runBetterMatches(copyMoveDetector& detector, WorkQueue &queue, int noThread,
+                          std::vector<Match> &matches, double &busy);
 }
\ No newline at end of file
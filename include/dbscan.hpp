@@ -3,14 +3,11 @@
 
 #include <vector>
 #include <cmath>
+#include <utility>
 
-#include "line.hpp"
-#include "ClusteredLine.hpp"
+#include "Segment.hpp"
 
-#define UNCLASSIFIED -1
 #define NOISE -2
-#define SUCCESS 0
-#define FAILURE -3
 
 /**
  * This class stands for a scanner using DBSCAN algorithm.
@@ -21,15 +18,38 @@
  * - (x,y) : closest end of the segment to (0, 0)
  * - theta : the polar angle of the segment
  * - l : the length of the segment
+ *
+ * The segments are read in place: the scanner only stores the label of each segment.
+ *
+ * Neighbourhoods are found through a uniform grid over (x, y): each region query only
+ * computes the distance to the lines of the cells overlapping a box that is known to
+ * hold the whole neighbourhood, and returns the same lines as a scan of every line.
+ *
+ * The features of the lines are copied once into a matrix stored by column, in the order of
+ * the grid, so that the lines of consecutive cells are contiguous. A region query computes the
+ * weights depending on its core line once, then compares the core line with blocks of lines
+ * in single precision, through weightedCandidates. Only the lines that may be in the
+ * neighbourhood are compared again with calculateDistance, which has the final say.
+ *
+ * The neighbourhood graph is computed once at radius eps, by DBSCAN::computeNeighbourhoods.
+ * Only the minPts nearest neighbours of each line are kept, sorted by distance, so that the
+ * k-th one gives the core distance of the line for minPts = k: the graph takes O(n minPts)
+ * memory however dense the lines are. DBSCAN::extract then builds the clusters for any minPts
+ * and any radius up to eps, running a region query again only for the core lines whose
+ * neighbourhood at that radius was cut. The core lines are merged with a lock-free union-find,
+ * so the labels don't depend on the number of threads.
  */
 class DBSCAN {
 public:
+    /**  The relative rounding error allowed on the distances computed in single precision  */
+    static constexpr float TOLERANCE = 1e-5f;
+
     /*
      * +==============+
      * | CONSTRUCTORS |
      * +==============+
      */
-    DBSCAN(unsigned int minPts, double eps, std::vector<defals::ClusteredLine>& lines,
+    DBSCAN(unsigned int minPts, double eps, const std::vector<defals::Segment>& lines,
            int height, int width,
            double wx, double wy, double wtheta);
 
@@ -38,7 +58,9 @@ public:
      * |  ALGORITHM  |
      * +=============+
      */
-    std::vector<defals::ClusteredLine> run();
+    void computeNeighbourhoods(int jobs);
+    std::vector<int> extract(unsigned int minPts, double eps, int jobs);
+    double coreDistance(int line, unsigned int minPts) const;
 
     /**
      * This function computes the distance between two segments defined as said above. Each of the four parameters
@@ -53,23 +75,27 @@ public:
      *
      * @return              The weighted distance of the two lines.
      */
-    inline double calculateDistance(const defals::ClusteredLine& pointCore, const defals::ClusteredLine& pointTarget) {
-        int sizeRatio = (_height + _width) / 2;
-        double wl = 1 - _wx - _wy - _wtheta;
-
-        return sqrt(_wx * pow(pointCore.getPoint1().pt.x - pointTarget.getPoint1().pt.x, 2) / sizeRatio +
-                    _wy * pow(pointCore.getPoint1().pt.y - pointTarget.getPoint1().pt.y, 2) / sizeRatio +
-                    _wtheta * pow(pointCore.getTheta() - pointTarget.getTheta(), 2) / pointCore.getTheta() +
-                       wl * pow(pointCore.length() - pointTarget.length(), 2) / pointCore.length());
+    inline double calculateDistance(const defals::Segment& pointCore, const defals::Segment& pointTarget) const {
+        return sqrt(_wx * pow(pointCore.x1 - pointTarget.x1, 2) / _sizeRatio +
+                    _wy * pow(pointCore.y1 - pointTarget.y1, 2) / _sizeRatio +
+                    _wtheta * pow(pointCore.theta - pointTarget.theta, 2) / pointCore.theta +
+                       _wl * pow(pointCore.length - pointTarget.length, 2) / pointCore.length);
     }
 
 private:
-    std::vector<int> calculateCluster(defals::ClusteredLine& point);
-    int expandCluster(defals::ClusteredLine& line, int clusterID);
+    std::vector<std::pair<double, int>> calculateNeighbourhood(int point) const;
+
+    void buildGrid();
+    void distanceCoefficients(const defals::Segment& core, double* coefficients) const;
+    bool searchBox(const defals::Segment& core, const double* coefficients, double& rx, double& ry) const;
+    static void cellRange(double center, double radius, double origin, double width, int count,
+                          int& first, int& last);
 
     /**  The lines we want to cluster  */
-    std::vector<defals::ClusteredLine> _lines;
-    /**  The minimal number of points in a neighbourhood */
+    const std::vector<defals::Segment>& _lines;
+    /**  The ID of the cluster of each line: NOISE or n > 0  */
+    std::vector<int> _labels;
+    /**  The minimal number of points in a neighbourhood, and the number of neighbours kept per line  */
     unsigned int _minPoints;
     /**  The radius of the considered neighbourhood */
     double _epsilon;
@@ -78,6 +104,34 @@ private:
     int _width;
 
     double _wx, _wy, _wtheta;
+    /**  The weight on parameter l: 1 - _wx - _wy - _wtheta  */
+    double _wl;
+    /**  The scale of the coordinates: the mean of the height and the width of the image  */
+    int _sizeRatio;
+
+    /**  The bounds of each feature over all the lines  */
+    double _minX, _maxX, _minY, _maxY, _minTheta, _maxTheta, _minLength, _maxLength;
+    /**  The number of cells of the grid along x and y  */
+    int _gridX, _gridY;
+    /**  The width of a cell along x and y  */
+    double _cellX, _cellY;
+    /**  The lines of cell c are _cellLines[_cellStart[c]] to _cellLines[_cellStart[c + 1] - 1]  */
+    std::vector<int> _cellStart;
+    /**  The lines sorted by cell, by increasing index within a cell  */
+    std::vector<int> _cellLines;
+    /**  The x, y, theta and length of the lines, in the order of _cellLines  */
+    std::vector<float> _features[4];
+
+    /**
+     * The nearest eps-neighbours of line i are _neighbours[_neighbourStart[i]] to _neighbours[_neighbourStart[i + 1] - 1],
+     * sorted by increasing distance, then by index. Empty until computeNeighbourhoods is called.
+     */
+    std::vector<int> _neighbourStart;
+    std::vector<int> _neighbours;
+    /**  The distance from each line to each of its kept neighbours  */
+    std::vector<double> _neighbourDistances;
+    /**  The number of eps-neighbours of each line, kept or not  */
+    std::vector<int> _neighbourhoodSizes;
 };
 
 #endif // DBSCAN_H
@@ -0,0 +1,162 @@
+/**
+ * @file    distance.hpp
+ * This file defines the kernels computing distances between
+ * descriptors during matching.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace defals {
+    class G2NNCollector;
+
+    /**
+     * Computes the squared euclidean distance between two descriptors.
+     *
+     * The kernel is chosen once at startup depending on the instruction sets supported
+     * by the processor: AVX-512, AVX2, SSE4.1 or plain C++. All of them accumulate the
+     * squared differences in the same 16 partial sums and reduce them in the same order,
+     * so they return bit-identical results. The environment variable DEFALS_KERNEL can name
+     * a narrower instruction set than the processor's, as returned by l2sqKernel.
+     *
+     * @param a     The first component of the first descriptor.
+     * @param b     The first component of the second descriptor.
+     * @param n     The number of components of the descriptors: 64, or 128 for extended SURF.
+     *
+     * @return      \f$||a - b||_2^2\f$
+     */
+    float l2sq(const float *a, const float *b, int n);
+
+    /**
+     * Same as l2sq, but gives up as soon as the distance is known to be at least _bound_.
+     *
+     * The components are read by blocks of 16, and the partial distance is checked against
+     * _bound_ after each block.
+     *
+     * @param a         The first component of the first descriptor.
+     * @param b         The first component of the second descriptor.
+     * @param n         The number of components of the descriptors: 64, or 128 for extended SURF.
+     * @param bound     The distance from which the exact value isn't needed anymore.
+     *
+     * @return      \f$||a - b||_2^2\f$ if it is below _bound_, otherwise a value between _bound_
+     *              and \f$||a - b||_2^2\f$.
+     */
+    float l2sqBounded(const float *a, const float *b, int n, float bound);
+
+    /**
+     * Computes the distances between a descriptor and a batch of candidates with the kernel of
+     * l2sqBounded, and pushes them in a collector. Each distance is bounded by the bound of the
+     * collector when it is computed.
+     *
+     * Kernels are specialised at compile time for 64 and 128 components, and the loop over the
+     * candidates is compiled along with each kernel: the kernel is chosen once per batch, and
+     * inlined in the loop.
+     *
+     * @param a         The first component of the descriptor.
+     * @param base      The first component of a matrix of descriptors, stored row after row.
+     * @param rows      The rows of the candidates in _base_, pushed as their indices.
+     * @param count     The number of candidates.
+     * @param n         The number of components of the descriptors.
+     * @param collector The collector receiving the distances.
+     */
+    void l2sqCollect(const float *a, const float *base, const int *rows, int count, int n,
+                     G2NNCollector &collector);
+
+    /**
+     * Same as l2sqCollect, but writes the distances instead of pushing them, each one being
+     * bounded by its own bound.
+     *
+     * @param bounds    The bound of each candidate.
+     * @param distances The distance to each candidate, as returned by l2sqBounded.
+     */
+    void l2sqBatch(const float *a, const float *base, const int *rows, int count, int n,
+                   const float *bounds, float *distances);
+
+    /**
+     * @return  The name of the instruction set used by l2sq.
+     */
+    const char *l2sqKernel();
+
+    /**
+     * Converts a float to a half-precision float, rounding to the nearest.
+     *
+     * @param value     The float.
+     *
+     * @return  The bits of the half-precision float.
+     */
+    uint16_t toHalf(float value);
+
+    /**
+     * Converts a half-precision float to a float. The conversion is exact.
+     *
+     * @param half      The bits of the half-precision float.
+     *
+     * @return  The float.
+     */
+    float fromHalf(uint16_t half);
+
+    /**
+     * Same as l2sq, for descriptors stored as half-precision floats.
+     *
+     * @param a     The first component of the first descriptor.
+     * @param b     The first component of the second descriptor.
+     * @param n     The number of components of the descriptors.
+     *
+     * @return      \f$||a - b||_2^2\f$, computed on the floats the halves stand for.
+     */
+    float l2sqHalf(const uint16_t *a, const uint16_t *b, int n);
+
+    /**
+     * Same as l2sq, for descriptors quantised to 8-bit integers: the k-th component of a
+     * descriptor stands for its integer value times _scales[k]_.
+     *
+     * @param a         The first component of the first descriptor.
+     * @param b         The first component of the second descriptor.
+     * @param scales    The scale of each component.
+     * @param n         The number of components of the descriptors.
+     *
+     * @return      \f$\sum_k (scales_k (a_k - b_k))^2\f$
+     */
+    float l2sqInt8(const int8_t *a, const int8_t *b, const float *scales, int n);
+
+    /**
+     * Batch version of l2sqHalf and l2sqInt8, for the element types _T_ uint16_t and int8_t:
+     * computes the distances between a compact descriptor and the given rows of a matrix of
+     * compact descriptors. The kernel is chosen once per batch, as for l2sqCollect.
+     *
+     * @param a         The first component of the descriptor.
+     * @param base      The first component of a matrix of descriptors, stored row after row.
+     * @param rows      The rows of the candidates in _base_.
+     * @param count     The number of candidates.
+     * @param scales    The scale of each component of 8-bit descriptors, ignored for half-precision ones.
+     * @param n         The number of components of the descriptors.
+     * @param distances The distance to each candidate.
+     */
+    template<class T>
+    void l2sqCompactBatch(const T *a, const T *base, const int *rows, int count, const float *scales, int n,
+                          float *distances);
+
+    /**
+     * Selects the rows of a matrix of 4 features, stored by column, that may be within _bound_
+     * of a point for a weighted squared distance:
+     *          \f$\sum_k scales_k (center_k - columns_k[r])^2\f$
+     * Scales may be negative. The distances are computed in single precision by blocks of 8 or
+     * 16 rows, depending on the instruction set, and a row is only dropped if its distance is
+     * over _bound_ by more than _tolerance_ times the sum of the absolute values of its terms.
+     * Rows whose distance isn't a number are kept.
+     *
+     * @param columns   The 4 columns of the matrix.
+     * @param first     The first row to consider.
+     * @param last      The row following the last row to consider.
+     * @param center    The features of the point.
+     * @param scales    The weight of each feature.
+     * @param bound     The squared distance from which rows can be dropped.
+     * @param tolerance The relative rounding error allowed on the distances.
+     * @param rows      The selected rows, by increasing index. It must be able to hold _last_ - _first_ rows.
+     *
+     * @return  The number of selected rows.
+     */
+    int weightedCandidates(const float *const *columns, int first, int last,
+                           const float *center, const float *scales, float bound, float tolerance, int *rows);
+}
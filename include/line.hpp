@@ -11,6 +11,7 @@
 #include <opencv2/xfeatures2d/nonfree.hpp>
 
 #include "InterestPoint.hpp"
+#include "Segment.hpp"
 
 namespace defals {
 
@@ -29,7 +30,9 @@ namespace defals {
          */
         Line(InterestPoint point1, InterestPoint point2);
 
-        Line(const Line &other);
+        explicit Line(const Segment &segment);
+
+        Line(const Line &other) = default;
 
         /*
          * +=========+
@@ -9,7 +9,7 @@ using namespace defals;
  * Constructs an InterestPoint from a KeyPoint. The angle and norm indices are
  * set to -1 because they don't belong to any of the two vectors yet.
  */
-InterestPoint::InterestPoint() : KeyPoint(), _angleIdx(-1), _normIdx(-1) {
+InterestPoint::InterestPoint() : KeyPoint(), _norm(0), _angleIdx(-1), _normIdx(-1) {
 }
 
 /**
@@ -19,7 +19,7 @@ InterestPoint::InterestPoint() : KeyPoint(), _angleIdx(-1), _normIdx(-1) {
  *
  * @param point     The point from which the InterestPoint is constructed.
  */
-InterestPoint::InterestPoint(const Point2f &point) : _angleIdx(-1), _normIdx(-1){
+InterestPoint::InterestPoint(const Point2f &point) : _norm(0), _angleIdx(-1), _normIdx(-1){
     this->pt = point;
 }
 
@@ -31,6 +31,18 @@ InterestPoint::InterestPoint(const Point2f &point) : _angleIdx(-1), _normIdx(-1)
  */
 InterestPoint::InterestPoint(const KeyPoint& keypoint, const Mat& descriptor) : KeyPoint(keypoint), _angleIdx(-1), _normIdx(-1) {
     _descriptor = descriptor;
+    _norm = norm(_descriptor, NORM_L2);
+}
+
+/**
+ * Constructs an InterestPoint from a KeyPoint, its descriptor and the norm of
+ * its descriptor when it has already been computed.
+ *
+ * @param keypoint      The keypoint.
+ * @param descriptor    The keypoint's descriptor: 1x64 or 1x128 float matrix.
+ * @param norm          The euclidean norm of _descriptor_.
+ */
+InterestPoint::InterestPoint(const KeyPoint& keypoint, const Mat& descriptor, float norm) : KeyPoint(keypoint), _descriptor(descriptor), _norm(norm), _angleIdx(-1), _normIdx(-1) {
 }
 
 /**
@@ -54,7 +66,7 @@ bool InterestPoint::descriptorEquals(const InterestPoint &other) const {
  *          of their respective descriptors is negative.
  */
 bool InterestPoint::descriptorLower(const InterestPoint &other) const {
-    return norm(_descriptor, NORM_L2) - norm(other._descriptor, NORM_L2) < 0;
+    return _norm - other._norm < 0;
 }
 
 /**
@@ -78,6 +90,15 @@ const cv::Mat& InterestPoint::getDescriptor() const {
     return _descriptor;
 }
 
+/**
+ * Getter for __norm_.
+ *
+ * @return  The euclidean norm of the keypoint's descriptor.
+ */
+float InterestPoint::getNorm() const {
+    return _norm;
+}
+
 /**
  * Prints keypoint in format (x, y).
  *
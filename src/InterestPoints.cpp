@@ -4,109 +4,505 @@
 
 #include "../include/InterestPoints.hpp"
 
+#include <numeric>
+
 using namespace std;
 using namespace cv;
 using namespace defals;
 
+thread_local long long InterestPoints::_avoided = 0;
+thread_local long long InterestPoints::_blockAvoided = 0;
+
 /**
  * Constructs a list of InterestPoint from keypoints and their descriptors.
  *
- * The two vectors are initialized with pointers to the InterestPoint objects.
+ * The keypoints are sorted by angle and copied into the flat arrays.
  *
  * @param keypoints     A vector of keypoints.
  * @param descriptors   The descriptors of the keypoints such as line i is the i-th keypoint's descriptor.
+ * @param jobs          The number of threads used to copy the descriptors and compute their norms.
+ * @param spillDirectory    If not empty, the descriptors are stored in a memory-mapped file
+ *                          created in this directory instead of in memory.
+ * @param source        The file _descriptors_ is mapped on, if any, which they're read from
+ *                      while they're copied.
  */
 InterestPoints::InterestPoints(const vector<KeyPoint>& keypoints, const Mat& descriptors,
-                               double angleThreshold, double normThreshold) {
-    for (size_t i = 0; i < keypoints.size(); i++) {
-        KeyPoint keypoint = keypoints[i];
-        Mat descriptor = descriptors.row(i);
-        shared_ptr<InterestPoint> point = make_shared<InterestPoint>(keypoint, descriptor);
-        _pointsSortedAngle.push_back(std::ref(point));
-        _pointsSortedNorm.emplace_back(std::ref(point));
-    }
-
+                               double angleThreshold, double normThreshold, int jobs,
+                               const string& spillDirectory, const MappedFile *source) {
     _angleThreshold = angleThreshold;
     _normThreshold = normThreshold;
+    _normWindow = normThreshold;
 
-    sort();
+    sort(keypoints, descriptors, jobs, spillDirectory, source);
 }
 
 /**
- * This function sorts the two vectors by angle and norm.
+ * Computes the euclidean norm of a descriptor.
+ *
+ * @param descriptor    The first component of the descriptor.
+ * @param n             The number of components of the descriptor.
+ *
+ * @return  The euclidean norm of the descriptor.
  */
-void InterestPoints::sort() {
-    std::sort(_pointsSortedNorm.begin(), _pointsSortedNorm.end(), [](const shared_ptr<InterestPoint>& a, const shared_ptr<InterestPoint>& b) {
-        return a->descriptorLower(*b);
-    });
-    std::sort(_pointsSortedAngle.begin(), _pointsSortedAngle.end(), [](const shared_ptr<InterestPoint>& a, const shared_ptr<InterestPoint>& b) {
-        return a->angleLower(*b);
+static float normL2(const float *descriptor, int n) {
+    double sum = 0;
+    for (int k = 0; k < n; k++)
+        sum += (double) descriptor[k] * descriptor[k];
+
+    return sqrt(sum);
+}
+
+/**
+ * This function sorts the keypoints by angle, fills the arrays in that order,
+ * then computes the permutation sorting them by norm.
+ *
+ * The descriptors are copied and their norms are computed by _jobs_ threads, so that
+ * sorting and windowing by norm only compare cached floats afterwards.
+ *
+ * Spilled descriptors are copied by chunks of SPILL_CHUNK rows, and each chunk is written
+ * to the file and given back once copied. The copy reads _descriptors_ in the angle order,
+ * that is at random: if they're mapped on _source_, they're read from the file instead of
+ * the mapping. Only a chunk per thread is then resident at once.
+ *
+ * @param keypoints     A vector of keypoints.
+ * @param descriptors   The descriptors of the keypoints such as line i is the i-th keypoint's descriptor.
+ * @param jobs          The number of threads.
+ * @param spillDirectory    The directory of the file holding the descriptors, empty to keep them in memory.
+ * @param source        The file _descriptors_ is mapped on, or nullptr.
+ */
+void InterestPoints::sort(const vector<KeyPoint>& keypoints, const Mat& descriptors, int jobs,
+                          const string& spillDirectory, const MappedFile *source) {
+    int n = keypoints.size();
+
+    vector<int> angleOrder(n);
+    iota(angleOrder.begin(), angleOrder.end(), 0);
+    std::sort(angleOrder.begin(), angleOrder.end(), [&keypoints](int a, int b) {
+        return keypoints[a].angle < keypoints[b].angle ||
+               (keypoints[a].angle == keypoints[b].angle && a < b);
     });
 
+    _angles.resize(n);
+    _x.resize(n);
+    _y.resize(n);
+    _sizes.resize(n);
+    _octaves.resize(n);
+    _responses.resize(n);
+    _norms.resize(n);
+
     /*
-     * Once sorted, we tell each InterestPoint their position in the vectors.
+     * Spilled descriptors are written straight to the mapped file, in the angle order:
+     * the matrix is only a view on it.
      */
-    for (int i = 0; i < size(); i++) {
-        _pointsSortedAngle[i]->setAngleIdx(i);
-        _pointsSortedNorm[i]->setNormIdx(i);
+    if (n > 0 && !spillDirectory.empty()) {
+        _spill = make_shared<MappedFile>(spillDirectory, (size_t) n * descriptors.cols * sizeof(float));
+        _descriptors = Mat(n, descriptors.cols, CV_32F, _spill->data());
+    }
+    else if (n > 0)
+        _descriptors.create(n, descriptors.cols, CV_32F);
+
+    auto fill = [&](int start, int end) {
+        for (int chunk = start; chunk < end; chunk += SPILL_CHUNK) {
+            int chunkEnd = min(end, chunk + SPILL_CHUNK);
+            for (int i = chunk; i < chunkEnd; i++) {
+                const KeyPoint& keypoint = keypoints[angleOrder[i]];
+                _angles[i] = keypoint.angle;
+                _x[i] = keypoint.pt.x;
+                _y[i] = keypoint.pt.y;
+                _sizes[i] = keypoint.size;
+                _octaves[i] = keypoint.octave;
+                _responses[i] = keypoint.response;
+
+                float *destination = _descriptors.ptr<float>(i);
+                if (source)
+                    source->read(angleOrder[i] * descriptors.step, destination, descriptors.cols * sizeof(float));
+                else {
+                    const float *row = descriptors.ptr<float>(angleOrder[i]);
+                    copy(row, row + descriptors.cols, destination);
+                }
+
+                _norms[i] = normL2(destination, descriptors.cols);
+            }
+
+            evictRows(chunk, chunkEnd);
+        }
+    };
+
+    if (jobs < 1)
+        jobs = 1;
+    int pointsByThread = (n + jobs - 1) / jobs;
+    vector<thread> threads;
+    for (int start = 0; start < n; start += pointsByThread)
+        threads.emplace_back(fill, start, min(n, start + pointsByThread));
+    for (auto& t : threads)
+        t.join();
+
+    if (_spill)
+        _spill->flush();
+
+    /*
+     * Once sorted, we tell each keypoint its position in the norm order.
+     */
+    _normOrder.resize(n);
+    iota(_normOrder.begin(), _normOrder.end(), 0);
+    std::sort(_normOrder.begin(), _normOrder.end(), [this](int a, int b) {
+        return _norms[a] < _norms[b] || (_norms[a] == _norms[b] && a < b);
+    });
+
+    _normIdx.resize(n);
+    _sortedNorms.resize(n);
+    for (int k = 0; k < n; k++) {
+        _normIdx[_normOrder[k]] = k;
+        _sortedNorms[k] = _norms[_normOrder[k]];
     }
 }
 
 /**
- * @return  An iterator at the start of the angles vector.
+ * @return  The number of InterestPoint.
  */
-vector<shared_ptr<InterestPoint>>::iterator InterestPoints::begin() {
-    return _pointsSortedAngle.begin();
+int InterestPoints::size() const {
+    return _angles.size();
 }
 
 /**
- * @return  An iterator at the end of the angles vector.
+ * @return  The number of components of a descriptor: 64, or 128 for extended SURF.
  */
-vector<shared_ptr<InterestPoint>>::iterator InterestPoints::end() {
-    return _pointsSortedAngle.end();
+int InterestPoints::descriptorSize() const {
+    return _descriptors.cols;
 }
 
 /**
- * @return  A const iterator at the start of the angles vector.
+ * Gets the descriptor of the i-th keypoint as a pointer to its row in the descriptors matrix.
+ *
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  A pointer to the first component of the i-th keypoint's descriptor.
  */
-std::vector<shared_ptr<InterestPoint>>::const_iterator InterestPoints::begin() const {
-    return _pointsSortedAngle.begin();
+const float *InterestPoints::descriptor(int i) const {
+    return _descriptors.ptr<float>(i);
 }
 
 /**
- * @return  A const iterator at the end of the angles vector.
+ * Gets the descriptor of the i-th keypoint as a 1xN matrix.
+ *
+ * The matrix doesn't own its data and doesn't touch the reference counter
+ * of the descriptors matrix: it must not outlive this object.
+ *
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  The descriptor of the i-th keypoint.
  */
-std::vector<shared_ptr<InterestPoint>>::const_iterator InterestPoints::end() const {
-    return _pointsSortedAngle.end();
+Mat InterestPoints::getDescriptor(int i) const {
+    return Mat(1, _descriptors.cols, CV_32F, const_cast<float *>(descriptor(i)));
 }
 
 /**
- * @return  The number of InterestPoint.
+ * @return A matrix of the descriptors of each keypoints, in the angle order.
  */
-int InterestPoints::size() const {
-    return _pointsSortedAngle.size();
+const Mat& InterestPoints::getDescriptors() const {
+    return _descriptors;
 }
 
 /**
- * Gets the descriptor of the i-th keypoint.
+ * @param i     The index of the keypoint in the angle order.
  *
- * @param i     The index of the InterestPoint in the angles vector.
+ * @return  The orientation of the i-th keypoint, in degrees.
+ */
+float InterestPoints::angle(int i) const {
+    return _angles[i];
+}
+
+/**
+ * @param i     The index of the keypoint in the angle order.
  *
- * @return  The descriptor of the i-th keypoint.
+ * @return  The euclidean norm of the i-th keypoint's descriptor.
  */
-const cv::Mat& InterestPoints::getDescriptor(int i) const {
-    return _pointsSortedAngle[i]->getDescriptor();
+float InterestPoints::descriptorNorm(int i) const {
+    return _norms[i];
 }
 
 /**
  * Wrapper for cv::KeyPoint's pt attribute.
  *
- * @param i     The index of the InterestPoint in the angles vector.
+ * @param i     The index of the keypoint in the angle order.
  *
  * @return      The Point2f representing the position of the keypoint in the picture.
  */
-const Point2f& InterestPoints::pt(int i) const {
-    return _pointsSortedAngle[i]->pt;
+Point2f InterestPoints::pt(int i) const {
+    return Point2f(_x[i], _y[i]);
+}
+
+/**
+ * Sets the minimal distance in pixels between two keypoints for them to be compared
+ * during matching. Keypoints closer than that can't make a line long enough to be kept,
+ * so they're skipped before their descriptors are compared.
+ *
+ * @param separation    The minimal distance in pixels, 0 to compare every keypoint.
+ */
+void InterestPoints::setMinSeparation(double separation) {
+    _squaredSeparation = (float) (separation * separation);
+}
+
+/**
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  The diameter of the i-th keypoint's neighbourhood.
+ */
+float InterestPoints::keypointSize(int i) const {
+    return _sizes[i];
+}
+
+/**
+ * Limits the number of keypoints in an angle window: only the _cap_ keypoints
+ * whose angle is the closest to the window's center are kept.
+ *
+ * @param cap   The maximal number of keypoints in a window, 0 for no limit.
+ */
+void InterestPoints::setCandidateCap(int cap) {
+    _candidateCap = max(cap, 0);
+}
+
+/**
+ * Sets the half-width of the norm windows, used by the norm and grid windows.
+ * It must be set before InterestPoints::buildGrid(int) is called.
+ *
+ * @param window    The half-width.
+ */
+void InterestPoints::setNormWindow(double window) {
+    _normWindow = window;
+}
+
+/**
+ * @return  The threshold of the angle windows, in degrees.
+ */
+double InterestPoints::angleThreshold() const {
+    return _angleThreshold;
+}
+
+/**
+ * @return  The highest norm of a candidate in the norm windows.
+ */
+double InterestPoints::normThreshold() const {
+    return _normThreshold;
+}
+
+/**
+ * @return  The half-width of the norm windows.
+ */
+double InterestPoints::normWindow() const {
+    return _normWindow;
+}
+
+/**
+ * @return  True if the descriptors are stored in a memory-mapped file.
+ */
+bool InterestPoints::spilled() const {
+    return _spill != nullptr;
+}
+
+/**
+ * @return  The copy of the descriptors scanned by the windows.
+ */
+DescriptorStorage InterestPoints::storage() const {
+    return _storage;
+}
+
+/**
+ * @return  The number of principal components the descriptors are projected on, 0 if they aren't.
+ */
+int InterestPoints::projectionSize() const {
+    return _projectionSize;
+}
+
+/**
+ * @return  The number of distances the calling thread didn't compute, as the projections
+ *          or the compact descriptors ruled them out, since the counter was last reset.
+ */
+long long InterestPoints::avoidedDistances() {
+    return _avoided;
+}
+
+/**
+ * @return  The number of distances the calling thread didn't compute, as the matrix products
+ *          of InterestPoints::similarityAngleBlock ruled them out, since the counter was last reset.
+ */
+long long InterestPoints::blockAvoidedDistances() {
+    return _blockAvoided;
+}
+
+/**
+ * Resets the counters of InterestPoints::avoidedDistances() and
+ * InterestPoints::blockAvoidedDistances() for the calling thread.
+ */
+void InterestPoints::resetAvoidedDistances() {
+    _avoided = 0;
+    _blockAvoided = 0;
+}
+
+/**
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  The octave the i-th keypoint was detected in.
+ */
+int InterestPoints::octave(int i) const {
+    return _octaves[i];
+}
+
+/**
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  The detector's response at the i-th keypoint.
+ */
+float InterestPoints::response(int i) const {
+    return _responses[i];
+}
+
+/**
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return  The position of the i-th keypoint in the norm order.
+ */
+int InterestPoints::normIdx(int i) const {
+    return _normIdx[i];
+}
+
+/**
+ * @param k     A position in the norm order.
+ *
+ * @return  The index in the angle order of the k-th keypoint in the norm order.
+ */
+int InterestPoints::atNorm(int k) const {
+    return _normOrder[k];
+}
+
+/**
+ * Builds the InterestPoint standing for the i-th keypoint. Its descriptor
+ * is a view on the descriptors matrix, thus the InterestPoint must not
+ * outlive this object.
+ *
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return      The i-th keypoint.
+ */
+InterestPoint InterestPoints::get(int i) const {
+    InterestPoint point(KeyPoint(pt(i), _sizes[i], _angles[i], _responses[i], _octaves[i]), getDescriptor(i), _norms[i]);
+    point.setAngleIdx(i);
+    point.setNormIdx(_normIdx[i]);
+
+    return point;
+}
+
+/**
+ * Overload of operator[] in order to access keypoints as in a vector.
+ *
+ * @param i     The index of the keypoint in the angle order.
+ *
+ * @return      The i-th InterestPoint.
+ */
+InterestPoint InterestPoints::operator[](int i) const {
+    assert(i >= 0 && i < size());
+
+    return get(i);
+}
+
+/**
+ * Casts all the keypoints to cv::KeyPoint.
+ *
+ * @return  A vector of cv::KeyPoint corresponding to the keypoints, in the angle order.
+ */
+vector<KeyPoint> InterestPoints::asKeyPoints() const {
+    vector<KeyPoint> points;
+    for (int i = 0; i < size(); i++) {
+        points.emplace_back(pt(i), _sizes[i], _angles[i], _responses[i], _octaves[i]);
+    }
+
+    return points;
+}
+
+/**
+ * Drops the candidates of the i-th keypoint whose distance is known to be at least their
+ * bound, counting them in __avoided_, and packs the others at the start of _rows_ and _bounds_.
+ * Without principal components nor compact descriptors, every candidate is kept.
+ *
+ * The principal components are orthonormal, so the distance between two projections
+ * is at most the distance between the descriptors.
+ *
+ * A compact descriptor is at most __errors[i]_ away from the float one, so by the
+ * triangle inequality the float distance is at least the compact one minus both errors.
+ *
+ * @param i         The index of the keypoint.
+ * @param rows      The candidates, at most CANDIDATE_BLOCK of them.
+ * @param bounds    The bound of each candidate.
+ * @param count     The number of candidates.
+ *
+ * @return  The number of candidates kept.
+ */
+int InterestPoints::reachableRows(int i, int *rows, float *bounds, int count) const {
+    float reaches[CANDIDATE_BLOCK], distances[CANDIDATE_BLOCK];
+
+    auto keep = [&]() {
+        int kept = 0;
+        for (int r = 0; r < count; r++) {
+            if (distances[r] >= reaches[r]) {
+                _avoided++;
+                continue;
+            }
+            rows[kept] = rows[r];
+            bounds[kept++] = bounds[r];
+        }
+        count = kept;
+    };
+
+    if (_projectionSize > 0) {
+        const int k = _projectionSize;
+        for (int r = 0; r < count; r++) {
+            float reach = sqrt(bounds[r]) * (1 + COMPACT_MARGIN) + _projectionSlack;
+            reaches[r] = reach * reach;
+        }
+        l2sqBatch(&_projections[(size_t) i * k], _projections.data(), rows, count, k, reaches, distances);
+        keep();
+    }
+
+    if (_storage != DescriptorStorage::FLOAT) {
+        const int n = descriptorSize();
+        for (int r = 0; r < count; r++) {
+            float reach = sqrt(bounds[r]) * (1 + COMPACT_MARGIN) + _errors[i] + _errors[rows[r]];
+            reaches[r] = reach * reach;
+        }
+        if (_storage == DescriptorStorage::HALF)
+            l2sqCompactBatch(&_halfDescriptors[(size_t) i * n], _halfDescriptors.data(), rows, count,
+                             _scales.data(), n, distances);
+        else
+            l2sqCompactBatch(&_int8Descriptors[(size_t) i * n], _int8Descriptors.data(), rows, count,
+                             _scales.data(), n, distances);
+        keep();
+    }
+
+    return count;
+}
+
+/**
+ * Computes the distances between the i-th keypoint and a block of candidates with a bounded
+ * kernel, unless their projections or compact descriptors already rule them out, and pushes
+ * them in _candidates_.
+ *
+ * @param i             The index of the keypoint.
+ * @param rows          The candidates, at most CANDIDATE_BLOCK of them. They're overwritten.
+ * @param count         The number of candidates.
+ * @param candidates    The collector receiving the distances.
+ */
+void InterestPoints::collectRows(int i, int *rows, int count, G2NNCollector& candidates) const {
+    if (count == 0)
+        return;
+
+    float bound = candidates.bound();
+    if (bound != numeric_limits<float>::infinity() &&
+        (_projectionSize > 0 || _storage != DescriptorStorage::FLOAT)) {
+        float bounds[CANDIDATE_BLOCK];
+        fill(bounds, bounds + count, bound);
+        count = reachableRows(i, rows, bounds, count);
+    }
+
+    l2sqCollect(descriptor(i), descriptor(0), rows, count, descriptorSize(), candidates);
 }
 
 /**
@@ -118,213 +514,1020 @@ const Point2f& InterestPoints::pt(int i) const {
  * - \f$\forall j \in [1, n]\setminus\lbrace i\rbrace,\; d_j = ||f_i - f_j||_2\f$
  * - the coordinates of \f$D\f$ are sorted by ascending order
  *
- * The code actually returns a map because as we need to sort the distances, we need to
- * keep the correspondance between a computed distance and the matching descriptor.
- * Thus, we return a map associating distances with the matching keypoint's index.
+ * The vector isn't stored entirely: each squared distance is pushed in _candidates_ with
+ * the index of the matching keypoint, which only keeps the head of the vector that the
+ * g2NN ratio test can reach. Distances are computed by l2sqBounded against the
+ * collector's bound: a candidate is abandoned as soon as its partial distance shows it
+ * can't change the ratio test anymore, which gives the same result as computing it entirely.
+ * With compact descriptors, a candidate is first ruled out from its compact distance when
+ * possible, and its float descriptor isn't read at all. Candidates are handed to the kernels
+ * by blocks, through InterestPoints::collectRows.
  *
  * Practically, this method only computes the similarity vector in a range
- * [_minIdx_, _maxIdx_] of the whole InterestPoint vector.
+ * [_minIdx_, _maxIdx_] of the angle order.
  *
- * @param   pt      The InterestPoint we want to compute a similarity vector of.
- * @param   minIdx  The first point we're going to compute the distance with.
- * @param   maxIdx  The last point we're going to compute the distance with.
+ * @param   i           The index of the keypoint we want to compute a similarity vector of.
+ * @param   candidates  The collector receiving the distances.
+ * @param   minIdx      The first point we're going to compute the distance with.
+ * @param   maxIdx      The last point we're going to compute the distance with.
+ */
+void InterestPoints::similarityAngle(int i, G2NNCollector& candidates, int minIdx, int maxIdx) const {
+    if (maxIdx == -1)
+        maxIdx = size() - 1;
+
+    int rows[CANDIDATE_BLOCK], count = 0;
+    for (int j = minIdx; j <= maxIdx; j++) {
+        if (i == j || !separated(i, j))
+            continue;
+
+        rows[count++] = j;
+        if (count == CANDIDATE_BLOCK) {
+            collectRows(i, rows, count, candidates);
+            count = 0;
+        }
+    }
+    collectRows(i, rows, count, candidates);
+}
+
+/**
+ * Same as InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const, except that the
+ * window [_minIdx_, _maxIdx_] is taken in the norm order and that keypoints whose
+ * descriptor's norm is above __normThreshold_ are ignored.
  *
- * @return  A map associating the euclidean distance between keypoint _pt_ and all the other
- *          keypoints in a [_minIdx_, _maxIdx_] window and the index of the corresponding other keypoints.
+ * The collected indices are still indices in the angle order.
  */
-std::map<double, InterestPoint> InterestPoints::similarityAngle(const InterestPoint& pt, int minIdx, int maxIdx) const {
+void InterestPoints::similarityNorm(int i, G2NNCollector& candidates, int minIdx, int maxIdx) const {
     if (maxIdx == -1)
         maxIdx = size() - 1;
 
+    int rows[CANDIDATE_BLOCK], count = 0;
+    for (int k = minIdx; k <= maxIdx; k++) {
+        int j = _normOrder[k];
+        if (i == j || !separated(i, j) || _norms[j] > _normThreshold)
+            continue;
+
+        rows[count++] = j;
+        if (count == CANDIDATE_BLOCK) {
+            collectRows(i, rows, count, candidates);
+            count = 0;
+        }
+    }
+    collectRows(i, rows, count, candidates);
+}
+
+/**
+ * Batched version of InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const
+ * for the keypoints in [_first_, _last_[, each of them being compared with its own angle window.
+ *
+ * Consecutive keypoints have nearly the same window, so the block of keypoints is compared
+ * with the union of their windows at once, using
+ *          \f$||a - b||_2^2 = ||a||_2^2 + ||b||_2^2 - 2 a \cdot b\f$
+ * where the dot products of a tile of the union are computed by a single cv::gemm call.
+ * Each keypoint then only reads the products of its own window in the tile.
+ *
+ * The expanded formula loses precision when descriptors are very close, so it only rules out
+ * candidates: its error is bounded by \f$(n + 8) \epsilon (||a||_2^2 + ||b||_2^2)\f$, and a
+ * candidate is skipped when the expanded distance minus that error is already at least the
+ * bound of the collector. Since the bound of a collector never increases, such a candidate
+ * would have been ignored by the collector anyway. Skipped candidates are counted in
+ * __blockAvoided_, apart from the ones ruled out by the prefilters. The other candidates are pushed with the
+ * same distance as in InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const,
+ * thus both give the same matches.
+ *
+ * @param first         The first keypoint of the block.
+ * @param last          The keypoint following the last keypoint of the block.
+ * @param candidates    The collectors receiving the distances, one for each keypoint of the block.
+ */
+void InterestPoints::similarityAngleBlock(int first, int last, vector<G2NNCollector>& candidates) const {
     /*
-     * This map will contain pairs <euclidean_distance, keypoint_index>
-     *
-     * I put euclidean distance as the key because a map is ordered by keys
+     * The number of candidates in a tile: the tile's descriptors and products
+     * should stay in cache while the keypoints of the block read them.
      */
-    map<double, InterestPoint> distances;
+    static const int TILE = 256;
 
-    Mat descriptor = _pointsSortedAngle[pt.getAngleIdx()]->getDescriptor();
+    vector<AngleWindow> windows;
+    vector<pair<int, int>> spans;
+    for (int i = first; i < last; i++) {
+        windows.emplace_back(getRangeAngle(i));
+        for (int r = 0; r < windows.back().nbRanges; r++)
+            spans.push_back(windows.back().ranges[r]);
+    }
 
-    for (int j = minIdx; j <= maxIdx; j++) {
-        if (pt.getAngleIdx() != j) {
-            Mat other = _pointsSortedAngle[j]->getDescriptor();
+    /*
+     * The union of the windows is made of at most three spans: the main ranges
+     * of the block, and the wrapped ones at both ends of the angle order.
+     */
+    std::sort(spans.begin(), spans.end());
+    vector<pair<int, int>> merged;
+    for (const auto& span : spans) {
+        if (!merged.empty() && span.first <= merged.back().second + 1)
+            merged.back().second = max(merged.back().second, span.second);
+        else
+            merged.push_back(span);
+    }
+
+    const int n = descriptorSize();
+    const float margin = (n + 8) * numeric_limits<float>::epsilon();
+
+    Mat queries = _descriptors.rowRange(first, last);
+    Mat products;
+
+    for (const auto& span : merged) {
+        for (int tileStart = span.first; tileStart <= span.second; tileStart += TILE) {
+            int tileEnd = min(tileStart + TILE, span.second + 1);
+
+            gemm(queries, _descriptors.rowRange(tileStart, tileEnd), -2, Mat(), 0, products, GEMM_2_T);
+
+            for (int i = first; i < last; i++) {
+                const AngleWindow& window = windows[i - first];
+                const float *row = products.ptr<float>(i - first);
+                float squaredNorm = _norms[i] * _norms[i];
+
+                G2NNCollector& collector = candidates[i - first];
+                int rows[CANDIDATE_BLOCK], count = 0;
 
-            double distance = norm(descriptor, other, NORM_L2);
-            //if (distance <= _normThreshold)
-            distances.insert({ distance, *_pointsSortedAngle[j] });
+                for (int r = 0; r < window.nbRanges; r++) {
+                    int from = max(window.ranges[r].first, tileStart);
+                    int to = min(window.ranges[r].second, tileEnd - 1);
+
+                    for (int j = from; j <= to; j++) {
+                        if (i == j || !separated(i, j))
+                            continue;
+
+                        float squaredNorms = squaredNorm + _norms[j] * _norms[j];
+                        float expanded = squaredNorms + row[j - tileStart];
+                        if (expanded - margin * squaredNorms >= collector.bound()) {
+                            _blockAvoided++;
+                            continue;
+                        }
+
+                        rows[count++] = j;
+                        if (count == CANDIDATE_BLOCK) {
+                            l2sqCollect(descriptor(i), descriptor(0), rows, count, n, collector);
+                            count = 0;
+                        }
+                    }
+                }
+                l2sqCollect(descriptor(i), descriptor(0), rows, count, n, collector);
+            }
         }
     }
-    return distances;
 }
 
 /**
- * @copydoc InterestPoints::similarityAngle(const InterestPoint&,int,int) const
+ * Symmetric version of InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const
+ * for the keypoints in [_first_, _last_[.
+ *
+ * Angle windows are symmetric: j is in the window of i if and only if i is in the window of j.
+ * Each distance is thus computed once, while processing the keypoint owning the pair, and
+ * pushed in the collectors of both keypoints. A pair belongs to:
+ * - its lowest index, when both keypoints are in each other's main range ;
+ * - its highest index otherwise, that is when the window wraps around 0°: the pair is found
+ *   in the range at the start of the angle order.
+ *
+ * A keypoint's collector only receives part of its candidates here: the collectors filled by
+ * every call for a keypoint must be merged, by pushing their candidates in a single collector,
+ * before running the ratio test. A candidate dropped by one of them couldn't have been reached
+ * by the ratio test on the merged candidates either.
+ *
+ * @param first     The first keypoint of the chunk.
+ * @param last      The keypoint following the last keypoint of the chunk.
+ * @param band      Filled with the collectors of the keypoints from _first_ on: band[k] is the
+ *                  collector of the (_first_ + k)-th keypoint.
+ * @param head      Filled with the collectors of the keypoints at the start of the angle
+ *                  order: head[k] is the collector of the k-th keypoint.
  */
-std::map<double, InterestPoint> InterestPoints::similarityNorm(const InterestPoint& pt, int minIdx, int maxIdx) const {
-    if (maxIdx == -1)
-        maxIdx = size() - 1;
+void InterestPoints::similaritySymmetric(int first, int last,
+                                         vector<G2NNCollector>& band, vector<G2NNCollector>& head) const {
+    const int n = descriptorSize();
+
+    vector<pair<int, int>> forward, backward;
+    int bandLast = last - 1, headLast = -1;
+    for (int i = first; i < last; i++) {
+        AngleWindow window = getRangeAngle(i);
+        pair<int, int> main(i + 1, i), wrapped(0, -1);
+        for (int r = 0; r < window.nbRanges; r++) {
+            const pair<int, int>& range = window.ranges[r];
+            if (range.first <= i && i <= range.second)
+                main = make_pair(i + 1, range.second);
+            else if (range.second < i)
+                wrapped = range;
+        }
+
+        forward.push_back(main);
+        backward.push_back(wrapped);
+        bandLast = max(bandLast, main.second);
+        headLast = max(headLast, wrapped.second);
+    }
+
+    band.assign(bandLast - first + 1, G2NNCollector());
+    head.assign(headLast + 1, G2NNCollector());
 
     /*
-     * This map will contain pairs <euclidean_distance, keypoint_index>
-     *
-     * I put euclidean distance as the key because a map is ordered by keys
+     * The candidates are bounded by both collectors when they're handed to the kernels: the
+     * bounds only decrease, so a later push of a distance over them is ignored anyway.
      */
-    map<double, InterestPoint> distances;
+    int rows[CANDIDATE_BLOCK];
+    float bounds[CANDIDATE_BLOCK], distances[CANDIDATE_BLOCK];
+    auto flush = [&](int i, int count, G2NNCollector *others, int offset) {
+        count = reachableRows(i, rows, bounds, count);
+        l2sqBatch(descriptor(i), descriptor(0), rows, count, n, bounds, distances);
 
-    Mat descriptor = _pointsSortedNorm[pt.getNormIdx()]->getDescriptor();
+        for (int r = 0; r < count; r++) {
+            band[i - first].push(distances[r], rows[r]);
+            others[rows[r] - offset].push(distances[r], i);
+        }
+    };
 
-    for (int j = minIdx; j <= maxIdx; j++) {
-        if (pt.getNormIdx() != j) {
-            Mat other = _pointsSortedNorm[j]->getDescriptor();
+    for (int i = first; i < last; i++) {
+        G2NNCollector& own = band[i - first];
+        int count = 0;
 
-            if (norm(other, NORM_L2) > _normThreshold)
+        for (int j = forward[i - first].first; j <= forward[i - first].second; j++) {
+            if (!separated(i, j))
                 continue;
 
-            double distance = norm(descriptor, other, NORM_L2);
+            rows[count] = j;
+            bounds[count++] = max(own.bound(), band[j - first].bound());
+            if (count == CANDIDATE_BLOCK) {
+                flush(i, count, band.data(), first);
+                count = 0;
+            }
+        }
+        flush(i, count, band.data(), first);
+        count = 0;
 
-            distances.insert({ distance, *_pointsSortedNorm[j] });
+        for (int j = backward[i - first].first; j <= backward[i - first].second; j++) {
+            if (!separated(i, j))
+                continue;
+
+            rows[count] = j;
+            bounds[count++] = max(own.bound(), head[j].bound());
+            if (count == CANDIDATE_BLOCK) {
+                flush(i, count, head.data(), 0);
+                count = 0;
+            }
         }
+        flush(i, count, head.data(), 0);
     }
-    return distances;
 }
 
 /**
- * @return A matrix of the descriptors of each keypoints.
+ * Builds the grid used by InterestPoints::similarityGrid(int,G2NNCollector&) const.
+ *
+ * The keypoints are bucketed by angle, by descriptor's norm and, if _octaveThreshold_
+ * is not negative, by octave. Cells are at least as wide as the angle threshold and the
+ * half-width of the norm windows, so that the keypoints of a window can only lie in the cell of the
+ * keypoint or in the neighbouring ones. The grid is stored as a compressed array: the
+ * keypoints are sorted by cell with a counting sort, and each cell is a range of that array.
+ *
+ * @param octaveThreshold   The maximal octave difference between two keypoints of a window,
+ *                          or -1 to ignore octaves.
  */
-Mat InterestPoints::getDescriptors() const {
-    Mat descriptors;
-    for (const auto& point : _pointsSortedAngle) {
-        descriptors.push_back(point->getDescriptor());
+void InterestPoints::buildGrid(int octaveThreshold) {
+    const int n = size();
+    _octaveThreshold = octaveThreshold;
+
+    /*
+     * The number of cells along an axis is also bounded by the number of keypoints,
+     * so that tiny thresholds don't make a grid larger than the keypoints themselves.
+     */
+    _gridAngles = max(1, min(n, (int) (360 / max(_angleThreshold, 1e-3))));
+    _cellAngle = 360.f / _gridAngles;
+
+    _minNorm = n > 0 ? _sortedNorms.front() : 0;
+    float normSpan = n > 0 ? _sortedNorms.back() - _minNorm : 0;
+    _cellNorm = max((float) _normWindow, normSpan / max(n, 1));
+    _gridNorms = _cellNorm > 0 ? (int) (normSpan / _cellNorm) + 1 : 1;
+
+    _minOctave = 0;
+    _gridOctaves = 1;
+    if (_octaveThreshold >= 0 && n > 0) {
+        auto bounds = minmax_element(_octaves.begin(), _octaves.end());
+        _minOctave = *bounds.first;
+        _gridOctaves = *bounds.second - _minOctave + 1;
+    }
+
+    vector<int> cells(n);
+    _cellStart.assign(_gridAngles * _gridNorms * _gridOctaves + 1, 0);
+    for (int i = 0; i < n; i++) {
+        int octaveCell = _octaveThreshold >= 0 ? _octaves[i] - _minOctave : 0;
+        cells[i] = gridCell(angleCell(_angles[i]), normCell(_norms[i]), octaveCell);
+        _cellStart[cells[i] + 1]++;
     }
-    return descriptors;
+    partial_sum(_cellStart.begin(), _cellStart.end(), _cellStart.begin());
+
+    _cellPoints.resize(n);
+    vector<int> next(_cellStart.begin(), _cellStart.end() - 1);
+    for (int i = 0; i < n; i++)
+        _cellPoints[next[cells[i]]++] = i;
 }
 
 /**
- * @param i     The index of the InterestPoint in the angles vector.
+ * Same as InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const, except that
+ * the i-th keypoint is only compared with the keypoints that are close to it by angle
+ * (going around the circle), by descriptor's norm and by octave when the grid has an
+ * octave axis: a candidate has to pass every threshold to be scored.
  *
- * @return      The i-th keypoint.
+ * Only the cells neighbouring the keypoint's cell are visited, and the thresholds are
+ * checked on the cached keys before any distance is computed.
+ *
+ * InterestPoints::buildGrid(int) must have been called beforehand.
+ *
+ * @param   i           The index of the keypoint we want to compute a similarity vector of.
+ * @param   candidates  The collector receiving the distances.
+ *
+ * @return  The number of distances computed.
+ */
+int InterestPoints::similarityGrid(int i, G2NNCollector& candidates) const {
+    /*
+     * With less than three cells, the neighbours of a cell are all of them:
+     * they're visited once.
+     */
+    int centerAngle = angleCell(_angles[i]);
+    int angleCells[3];
+    int nbAngleCells = min(_gridAngles, 3);
+    for (int k = 0; k < nbAngleCells; k++)
+        angleCells[k] = nbAngleCells < 3 ? k : (centerAngle + k - 1 + _gridAngles) % _gridAngles;
+
+    int centerNorm = normCell(_norms[i]);
+    int firstNorm = max(centerNorm - 1, 0);
+    int lastNorm = min(centerNorm + 1, _gridNorms - 1);
+
+    int firstOctave = 0, lastOctave = 0;
+    if (_octaveThreshold >= 0) {
+        int centerOctave = _octaves[i] - _minOctave;
+        firstOctave = max(centerOctave - _octaveThreshold, 0);
+        lastOctave = min(centerOctave + _octaveThreshold, _gridOctaves - 1);
+    }
+
+    int computed = 0;
+    int rows[CANDIDATE_BLOCK], count = 0;
+    for (int a = 0; a < nbAngleCells; a++) {
+        for (int b = firstNorm; b <= lastNorm; b++) {
+            for (int c = firstOctave; c <= lastOctave; c++) {
+                int cell = gridCell(angleCells[a], b, c);
+
+                for (int k = _cellStart[cell]; k < _cellStart[cell + 1]; k++) {
+                    int j = _cellPoints[k];
+                    if (i == j || !separated(i, j) || !inWindow(i, j, MatchingWindow::GRID))
+                        continue;
+
+                    rows[count++] = j;
+                    computed++;
+                    if (count == CANDIDATE_BLOCK) {
+                        collectRows(i, rows, count, candidates);
+                        count = 0;
+                    }
+                }
+            }
+        }
+    }
+    collectRows(i, rows, count, candidates);
+
+    return computed;
+}
+
+/**
+ * Builds the approximate nearest neighbours index used by
+ * InterestPoints::similarityIndex(int,G2NNCollector&,MatchingWindow,int) const:
+ * a forest of randomized kd-trees over the descriptors.
+ *
+ * @param trees     The number of trees of the forest.
  */
-const InterestPoint &InterestPoints::get(int i) const {
-    return *_pointsSortedAngle[i];
+void InterestPoints::buildIndex(int trees) {
+    if (size() == 0)
+        return;
+
+    _index = makePtr<flann::Index>(_descriptors, flann::KDTreeIndexParams(trees));
+    _indexLock = make_shared<mutex>();
 }
 
 /**
- * Casts all the InterestPoint to cv::KeyPoint.
+ * Same as InterestPoints::similarityAngle(int,G2NNCollector&,int,int) const, except that
+ * the candidates are the approximate nearest neighbours of the i-th keypoint given by the
+ * index, instead of every keypoint of a window. Neighbours outside of _window_ are dropped
+ * and the distances of the others are computed exactly.
+ *
+ * Only the G2NNCollector::CAPACITY (16) nearest neighbours are asked for, which is as many
+ * candidates as the collector can hold: a keypoint never has more than 16 candidates scored,
+ * which bounds the recall of approximate matching whatever the number of checks.
+ *
+ * cv::flann::Index::knnSearch isn't thread-safe, so the searches of concurrent threads are
+ * serialized; the exact distances are computed outside of the lock. The results don't depend
+ * on the number of threads.
+ *
+ * InterestPoints::buildIndex(int) must have been called beforehand.
  *
- * @return  A vector of cv::KeyPoint corresponding to the InterestPoint.
+ * @param   i           The index of the keypoint we want to compute a similarity vector of.
+ * @param   candidates  The collector receiving the distances.
+ * @param   window      The window the candidates must belong to.
+ * @param   checks      The number of leaves visited by the search: the higher, the closer to exact.
+ *
+ * @return  The number of distances computed.
  */
-vector<KeyPoint> InterestPoints::asKeyPoints() const {
-    vector<KeyPoint> points;
-    for (const auto& pt : _pointsSortedAngle) {
-        points.emplace_back(*pt);
+int InterestPoints::similarityIndex(int i, G2NNCollector& candidates, MatchingWindow window, int checks) const {
+    const int k = min(G2NNCollector::CAPACITY, size());
+
+    Mat indices, distances;
+    {
+        lock_guard<mutex> lock(*_indexLock);
+        _index->knnSearch(getDescriptor(i), indices, distances, k, flann::SearchParams(checks));
     }
 
-    return points;
+    int rows[G2NNCollector::CAPACITY], computed = 0;
+    for (int l = 0; l < k; l++) {
+        int j = indices.at<int>(0, l);
+        if (j < 0 || j == i || !separated(i, j) || !inWindow(i, j, window))
+            continue;
+
+        rows[computed++] = j;
+    }
+    collectRows(i, rows, computed, candidates);
+
+    return computed;
 }
 
 /**
-  * Overload of operator[] in order to access keypoints as in a vector.
-  *
- * @param i     The index of the keypoint in angle vector.
+ * Tells whether the j-th keypoint belongs to the window of the i-th one, without
+ * computing the window:
+ * - ANGLE: their angles are closer than __angleThreshold_, going around the circle ;
+ * - NORM: their descriptors' norms are closer than __normWindow_, and the j-th one
+ *   is not above __normThreshold_ ;
+ * - GRID: their angles are closer than __angleThreshold_, their norms are closer than
+ *   __normWindow_, and their octaves are not further than the octave
+ *   threshold given to InterestPoints::buildGrid(int).
  *
- * @return      The i-th InterestPoint.
+ * @param i         The index of the keypoint at the center of the window.
+ * @param j         The index of the candidate.
+ * @param window    The kind of window.
+ *
+ * @return  True if the j-th keypoint is a candidate for the i-th one.
  */
-const InterestPoint &InterestPoints::operator[](int i) const {
-    assert(i >= 0 && (size_t) i < _pointsSortedAngle.size());
+bool InterestPoints::inWindow(int i, int j, MatchingWindow window) const {
+    float angleDistance = abs(_angles[i] - _angles[j]);
+    angleDistance = min(angleDistance, 360 - angleDistance);
+    bool closeAngle = angleDistance < _angleThreshold;
+    bool closeNorm = abs(_norms[i] - _norms[j]) < _normWindow;
 
-    return *_pointsSortedAngle[i];
+    switch (window) {
+        case MatchingWindow::ANGLE:
+            return closeAngle;
+        case MatchingWindow::NORM:
+            return closeNorm && _norms[j] <= _normThreshold;
+        case MatchingWindow::GRID:
+            return closeAngle && closeNorm &&
+                   (_octaveThreshold < 0 || abs(_octaves[i] - _octaves[j]) <= _octaveThreshold);
+    }
+
+    return false;
 }
 
 /**
- * Given an InterestPoint _pt_, computes the indices of a window
- * around _pt_ containing only points whose angle is not further
- * from _pt_'s by __angleThreshold_ degrees.
+ * Builds the compact copy of the descriptors scanned by the windows, and bounds the
+ * error of each compact descriptor. The float descriptors are kept: the candidates
+ * the compact descriptors can't rule out are scored with them, which gives the same
+ * result as scanning the float descriptors.
  *
- * @param pt    The InterestPoint we want a window around.
+ * The 8-bit descriptors have one scale per component, mapping the largest absolute
+ * value of that component to 127.
  *
- * @return  A pair of indices representing the window [_minIdx_, _maxIdx_]
+ * @param storage   The kind of compact descriptors, FLOAT to drop them.
  */
-pair<int, int> InterestPoints::getRangeAngle(const InterestPoint& pt) const {
-    return getRange(_pointsSortedAngle,
-                    pt.getAngleIdx(),
-                    [](const InterestPoint& a, const InterestPoint& b) {
-                        double angleA = a.angle;
-                        double angleB = b.angle;
-                        return abs(angleA - angleB);
-                    },
-                    _angleThreshold);
+void InterestPoints::buildCompactDescriptors(DescriptorStorage storage) {
+    const int n = size();
+    const int dim = descriptorSize();
+
+    _storage = storage;
+    _halfDescriptors.clear();
+    _int8Descriptors.clear();
+    _scales.clear();
+    _errors.clear();
+    if (_storage == DescriptorStorage::FLOAT)
+        return;
+
+    if (_storage == DescriptorStorage::INT8) {
+        _scales.assign(dim, 0);
+        for (int i = 0; i < n; i++) {
+            const float *row = descriptor(i);
+            for (int k = 0; k < dim; k++)
+                _scales[k] = max(_scales[k], abs(row[k]));
+            if ((i + 1) % SPILL_CHUNK == 0)
+                evictRows(i + 1 - SPILL_CHUNK, i + 1);
+        }
+        evictRows(n / SPILL_CHUNK * SPILL_CHUNK, n);
+        for (auto& scale : _scales)
+            scale = scale > 0 ? scale / 127 : 1;
+
+        _int8Descriptors.resize((size_t) n * dim);
+    }
+    else
+        _halfDescriptors.resize((size_t) n * dim);
 
+    _errors.resize(n);
+    for (int i = 0; i < n; i++) {
+        const float *row = descriptor(i);
+        double error = 0;
+        for (int k = 0; k < dim; k++) {
+            float value;
+            if (_storage == DescriptorStorage::INT8) {
+                int8_t quantised = (int8_t) max(-127.f, min(127.f, nearbyint(row[k] / _scales[k])));
+                _int8Descriptors[(size_t) i * dim + k] = quantised;
+                value = quantised * _scales[k];
+            }
+            else {
+                uint16_t half = toHalf(row[k]);
+                _halfDescriptors[(size_t) i * dim + k] = half;
+                value = fromHalf(half);
+            }
+            error += ((double) row[k] - value) * ((double) row[k] - value);
+        }
+
+        _errors[i] = nextafter((float) sqrt(error), numeric_limits<float>::infinity());
+        if ((i + 1) % SPILL_CHUNK == 0)
+            evictRows(i + 1 - SPILL_CHUNK, i + 1);
+    }
+    evictRows(n / SPILL_CHUNK * SPILL_CHUNK, n);
 }
 
 /**
- * Given an InterestPoint _pt_, computes the indices of a window
- * around _pt_ containing only points whose descriptor's norm is not further
- * from _pt_'s by __normThreshold_.
+ * Learns the first principal components of the descriptors, and projects the descriptors
+ * on them. The components are learnt from at most PCA_SAMPLES descriptors, evenly spread
+ * in the angle order.
  *
- * @param pt    The InterestPoint we want a window around.
+ * @param dimensions    The number of components.
+ */
+void InterestPoints::learnProjection(int dimensions) {
+    const int n = size();
+    const int samples = min(n, PCA_SAMPLES);
+    if (samples == 0 || dimensions <= 0)
+        return;
+
+    /*
+     * Spilled samples are read from the file, as reading them through the mapping would map most of it.
+     */
+    Mat data(samples, descriptorSize(), CV_32F);
+    for (int s = 0; s < samples; s++) {
+        int i = (long) n * s / samples;
+        if (_spill)
+            _spill->read(i * _descriptors.step, data.ptr(s), descriptorSize() * sizeof(float));
+        else
+            getDescriptor(i).copyTo(data.row(s));
+    }
+
+    PCA pca(data, noArray(), PCA::DATA_AS_ROW, min(dimensions, descriptorSize()));
+    project(pca.eigenvectors);
+}
+
+/**
+ * Projects the descriptors on principal components read from a file, so that
+ * every image is projected the same way.
  *
- * @return  A pair of indices representing the window [_minIdx_, _maxIdx_]
+ * @param path  The file, as written by cv::PCA::write.
  */
-pair<int, int> InterestPoints::getRangeNorm(const InterestPoint& pt) const {
-    return getRange(_pointsSortedNorm,
-                    pt.getNormIdx(),
-                    [](const InterestPoint& a, const InterestPoint& b) {
-                        return abs(norm(a.getDescriptor(), NORM_L2) - norm(b.getDescriptor(), NORM_L2));
-                    },
-                    _normThreshold);
+void InterestPoints::loadProjection(const string& path) {
+    FileStorage file(path, FileStorage::READ);
+    if (!file.isOpened()) {
+        cerr << "Couldn't open the principal components file " << path << endl;
+        exit(1);
+    }
+
+    PCA pca;
+    pca.read(file.root());
+    if (pca.eigenvectors.empty() || pca.eigenvectors.cols != descriptorSize()) {
+        cerr << "The principal components in " << path << " don't have " << descriptorSize() << " values" << endl;
+        exit(1);
+    }
+
+    project(pca.eigenvectors);
 }
 
+/**
+ * Projects the descriptors on the space spanned by _components_. The components are
+ * made orthonormal first, in double precision: the distance between two projections is
+ * then a lower bound of the distance between the descriptors, which is what makes
+ * ruling out candidates from their projections exact.
+ *
+ * Spilled descriptors are read in order and given back by chunks of SPILL_CHUNK rows.
+ *
+ * @param components    The components, one per row.
+ */
+void InterestPoints::project(const Mat& components) {
+    const int n = size();
+    const int dim = descriptorSize();
+
+    Mat basis;
+    components.convertTo(basis, CV_64F);
+    for (int c = 0; c < basis.rows; c++) {
+        double *row = basis.ptr<double>(c);
+        for (int p = 0; p < c; p++) {
+            const double *previous = basis.ptr<double>(p);
+            double dot = 0;
+            for (int k = 0; k < dim; k++)
+                dot += row[k] * previous[k];
+            for (int k = 0; k < dim; k++)
+                row[k] -= dot * previous[k];
+        }
+
+        double length = 0;
+        for (int k = 0; k < dim; k++)
+            length += row[k] * row[k];
+        length = sqrt(length);
+        if (length < 1e-6) {
+            cerr << "The principal components of the descriptors are not independent" << endl;
+            exit(1);
+        }
+        for (int k = 0; k < dim; k++)
+            row[k] /= length;
+    }
+
+    _projectionSize = basis.rows;
+    _projections.resize((size_t) n * _projectionSize);
+
+    double largest = 0;
+    for (int i = 0; i < n; i++) {
+        const float *row = descriptor(i);
+        double squaredNorm = 0;
+        for (int c = 0; c < _projectionSize; c++) {
+            const double *component = basis.ptr<double>(c);
+            double value = 0;
+            for (int k = 0; k < dim; k++)
+                value += component[k] * row[k];
+
+            _projections[(size_t) i * _projectionSize + c] = (float) value;
+            squaredNorm += value * value;
+        }
+        largest = max(largest, squaredNorm);
+        if ((i + 1) % SPILL_CHUNK == 0)
+            evictRows(i + 1 - SPILL_CHUNK, i + 1);
+    }
+    evictRows(n / SPILL_CHUNK * SPILL_CHUNK, n);
+
+    /*
+     * Rounding the coordinates to floats moves each projection by at most half an epsilon
+     * of its norm, and the difference of two projections by at most an epsilon of the largest
+     * norm: the slack is a few times that.
+     */
+    _projectionSlack = (float) (4 * sqrt(largest) * numeric_limits<float>::epsilon());
+}
+
+/**
+ * @return  The distance between two angles in degrees, going around the circle.
+ */
+static inline float circularDistance(float a, float b) {
+    float distance = abs(a - b);
+    return min(distance, 360 - distance);
+}
 
 /**
- * This function actually computes the [minIdx, maxIdx] window described in:
- * - InterestPoints::getRangeAngle(const InterestPoint&) const
- * - InterestPoints::getRangeNorm(const InterestPoint&) const
+ * Sets the threshold of the angle windows so that they hold about _budget_ keypoints.
  *
- * @param pts           The **SORTED** vector from which the window will be selected.
- * @param i             The index of the keypoint at the center of the window in _pts_.
- * @param comp          The comparison function.
- * @param threshold     The threshold above which a point will not be selected.
+ * For each sampled keypoint, the angle distance to its _budget_-th closest keypoint is the
+ * smallest threshold giving it a window of _budget_ keypoints. The median of these distances
+ * is kept, so that half of the windows are at most _budget_ keypoints large.
  *
- * @return  A window [minIdx, maxIdx] around the _i_-th keypoint of _pts_ such as:
+ * @param budget    The number of keypoints wanted in a window.
+ * @param samples   The number of keypoints sampled, evenly spread in the angle order.
  *
- *          \f$ \forall j \in [\mathrm{minIdx}, \mathrm{maxIdx}], comp(pts[i], pts[j]) < \mathrm{threshold}\f$
+ * @return  The new threshold of the angle windows.
  */
-pair<int, int> InterestPoints::getRange(const vector<shared_ptr<InterestPoint>>& pts,
-                                        int i,
-                                        double (comp) (const InterestPoint&, const InterestPoint&),
-                                        double threshold) const {
-    InterestPoint pt = *pts[i];
+double InterestPoints::tuneAngleThreshold(int budget, int samples) {
+    const int n = size();
+    samples = min(samples, n);
+    if (samples == 0 || budget <= 0)
+        return _angleThreshold;
 
-    int minIdx = i;
-    while (minIdx >= 0) {
-        InterestPoint other = *pts[minIdx];
+    vector<float> distances;
+    for (int s = 0; s < samples; s++) {
+        int left, right;
+        distances.push_back(walkAngles((long) n * s / samples, budget, 360, left, right));
+    }
 
-        if (comp(pt, other) >= threshold)
-            break;
+    nth_element(distances.begin(), distances.begin() + samples / 2, distances.end());
+    _angleThreshold = nextafter(distances[samples / 2], numeric_limits<float>::infinity());
+
+    return _angleThreshold;
+}
 
-        minIdx--;
+/**
+ * Same as InterestPoints::tuneAngleThreshold(int,int), for the half-width of the norm windows.
+ *
+ * SURF descriptors are normalised, so the tuned half-width is much lower than the norm
+ * threshold: only the width of the windows is tuned, candidates whose norm is above the
+ * norm threshold are still ignored.
+ *
+ * @return  The new half-width of the norm windows.
+ */
+double InterestPoints::tuneNormWindow(int budget, int samples) {
+    const int n = size();
+    samples = min(samples, n);
+    if (samples == 0 || budget <= 0)
+        return _normWindow;
+
+    vector<float> distances;
+    for (int s = 0; s < samples; s++) {
+        int k = _normIdx[(long) n * s / samples];
+
+        /*
+         * Walks away from the keypoint in the sorted norms, taking the closest one each time.
+         */
+        int below = k - 1, above = k + 1;
+        float distance = 0;
+        for (int taken = 0; taken < budget && (below >= 0 || above < n); taken++) {
+            float distanceBelow = below >= 0 ? _sortedNorms[k] - _sortedNorms[below] : numeric_limits<float>::infinity();
+            float distanceAbove = above < n ? _sortedNorms[above] - _sortedNorms[k] : numeric_limits<float>::infinity();
+            if (distanceBelow <= distanceAbove) {
+                distance = distanceBelow;
+                below--;
+            }
+            else {
+                distance = distanceAbove;
+                above++;
+            }
+        }
+        distances.push_back(distance);
     }
-    if (minIdx < 0)
-        minIdx = 0;
 
-    int maxIdx = i;
-    while (maxIdx < size()) {
-        InterestPoint other = *pts[maxIdx];
+    nth_element(distances.begin(), distances.begin() + samples / 2, distances.end());
+    _normWindow = nextafter(distances[samples / 2], numeric_limits<float>::infinity());
+
+    return _normWindow;
+}
+
+/**
+ * Measures the number of keypoints in the windows of sampled keypoints.
+ * The grid window is measured by checking the keypoints of the angle window containing it,
+ * its octaves being ignored until InterestPoints::buildGrid(int) is called.
+ *
+ * @param window    The kind of window.
+ * @param samples   The number of keypoints sampled, evenly spread in the angle order.
+ *
+ * @return  The sizes of the windows, sorted.
+ */
+vector<int> InterestPoints::sampleWindowSizes(MatchingWindow window, int samples) const {
+    const int n = size();
+    samples = min(samples, n);
+
+    vector<int> sizes;
+    for (int s = 0; s < samples; s++) {
+        int i = (long) n * s / samples;
+        if (window == MatchingWindow::NORM) {
+            pair<int, int> range = getRangeNorm(i);
+            sizes.push_back(range.second - range.first + 1);
+        }
+        else if (window == MatchingWindow::GRID) {
+            AngleWindow angles = getUncappedRangeAngle(i);
+            int count = 0;
+            for (int r = 0; r < angles.nbRanges; r++) {
+                for (int j = angles.ranges[r].first; j <= angles.ranges[r].second; j++)
+                    count += inWindow(i, j, MatchingWindow::GRID);
+            }
+            sizes.push_back(count);
+        }
+        else
+            sizes.push_back(getRangeAngle(i).size());
+    }
+    std::sort(sizes.begin(), sizes.end());
+
+    return sizes;
+}
+
+/**
+ * Walks around the i-th keypoint in the angle order, going around the circle, and
+ * takes the closest keypoint by angle at each step. Stops once _count_ keypoints are
+ * taken, or when the closest keypoint left is at least _threshold_ degrees away.
+ *
+ * @param i             The keypoint at the center of the walk.
+ * @param count         The maximal number of keypoints taken.
+ * @param threshold     The angle distance from which keypoints aren't taken.
+ * @param left          The number of keypoints taken before _i_.
+ * @param right         The number of keypoints taken after _i_.
+ *
+ * @return  The angle distance of the last keypoint taken, 0 if none was.
+ */
+float InterestPoints::walkAngles(int i, int count, double threshold, int& left, int& right) const {
+    const int n = size();
+    left = right = 0;
+
+    float distance = 0;
+    for (int taken = 0; taken < count && left + right < n - 1; taken++) {
+        int before = (i - left - 1 + n) % n;
+        int after = (i + right + 1) % n;
+        float distanceBefore = circularDistance(_angles[i], _angles[before]);
+        float distanceAfter = circularDistance(_angles[i], _angles[after]);
 
-        if (comp(pt, other) >= threshold)
+        float next = min(distanceBefore, distanceAfter);
+        if (next >= threshold)
             break;
 
-        maxIdx++;
+        distance = next;
+        if (distanceBefore <= distanceAfter)
+            left++;
+        else
+            right++;
     }
-    if (maxIdx >= size())
-        maxIdx = size() - 1;
 
-    return make_pair(minIdx, maxIdx);
+    return distance;
+}
+
+/**
+ * @return  The window made of the keypoints from _left_ keypoints before the i-th one
+ *          to _right_ keypoints after it, going around the circle.
+ */
+AngleWindow InterestPoints::circularWindow(int i, int left, int right) const {
+    const int n = size();
+
+    AngleWindow window;
+    window.add(max(i - left, 0), min(i + right, n - 1));
+    if (i - left < 0)
+        window.add(n + i - left, n - 1);
+    else if (i + right >= n)
+        window.add(0, i + right - n);
+
+    return window;
+}
+
+/**
+ * Tells the system that the descriptors of the angle windows of the keypoints
+ * in [_first_, _last_[ are going to be read soon. Does nothing unless the
+ * descriptors are spilled.
+ *
+ * @param first     The first keypoint.
+ * @param last      The keypoint following the last keypoint.
+ */
+void InterestPoints::pageWindow(int first, int last) const {
+    if (!_spill || first >= last)
+        return;
+
+    const size_t row = _descriptors.step;
+    int begin = mainRange(first).first;
+    int end = mainRange(last - 1).second;
+
+    _spill->prefetch(begin * row, (end + 1) * row);
+}
+
+/**
+ * Gives the memory holding the descriptors back to the system, up to the angle window
+ * of the i-th keypoint. The keypoints whose angle window wraps around 360° are kept, as
+ * the last keypoints still need them. Does nothing unless the descriptors are spilled.
+ *
+ * Released descriptors are read from the file again if they're needed.
+ *
+ * @param i     The first keypoint still being matched.
+ */
+void InterestPoints::releaseBefore(int i) const {
+    if (!_spill || i >= size())
+        return;
+
+    const size_t row = _descriptors.step;
+    int head = lower_bound(_angles.begin(), _angles.end(), (float) _angleThreshold) - _angles.begin();
+    int first = mainRange(i).first;
+
+    _spill->release(head * row, first * row);
+}
+
+/**
+ * Writes the descriptors of the keypoints in [_first_, _last_[ to the file and gives
+ * their memory back to the system. Does nothing unless the descriptors are spilled.
+ *
+ * @param first     The first keypoint.
+ * @param last      The keypoint following the last keypoint.
+ */
+void InterestPoints::evictRows(int first, int last) const {
+    if (!_spill || first >= last)
+        return;
+
+    const size_t row = _descriptors.step;
+    _spill->evict(first * row, last * row);
 }
 
-pair<int, int> InterestPoints::getRelativeRangeNorm(const InterestPoint& center, const InterestPoint& end) const {
-    int centerIdx = center.getNormIdx();
-    int endIdx = end.getNormIdx();
+/**
+ * @param i     The index of a keypoint in the angle order.
+ *
+ * @return  The range of the angle window of the i-th keypoint containing it.
+ */
+pair<int, int> InterestPoints::mainRange(int i) const {
+    AngleWindow window = getRangeAngle(i);
+    for (int r = 0; r < window.nbRanges; r++) {
+        if (window.ranges[r].first <= i && i <= window.ranges[r].second)
+            return window.ranges[r];
+    }
+
+    return make_pair(i, i);
+}
+
+/**
+ * Given the i-th keypoint, computes the indices of a window
+ * around it containing only points whose angle is strictly closer
+ * to its own than __angleThreshold_ degrees, going around the circle.
+ *
+ * The bounds are found by binary search in the sorted angles. When the
+ * window goes past 0° or 360°, the keypoints found at the other end of
+ * the angle order make a second range.
+ *
+ * If a candidate cap is set, only the closest keypoints by angle are kept:
+ * the window is then found by walking around the keypoint instead.
+ *
+ * @param i     The index of the keypoint we want a window around.
+ *
+ * @return  The ranges of the window in the angle order.
+ */
+AngleWindow InterestPoints::getRangeAngle(int i) const {
+    if (_candidateCap > 0) {
+        int left, right;
+        walkAngles(i, _candidateCap, _angleThreshold, left, right);
+        return circularWindow(i, left, right);
+    }
+
+    return getUncappedRangeAngle(i);
+}
+
+/**
+ * Same as InterestPoints::getRangeAngle(int) const, ignoring the candidate cap. This is
+ * the angle range the grid window is taken from, as the grid doesn't apply the cap.
+ *
+ * @param i     The index of the keypoint we want a window around.
+ *
+ * @return  The ranges of the window in the angle order.
+ */
+AngleWindow InterestPoints::getUncappedRangeAngle(int i) const {
+    AngleWindow window;
+    if (_angleThreshold >= 180) {
+        window.add(0, size() - 1);
+        return window;
+    }
+
+    double key = _angles[i];
+    double low = key - _angleThreshold;
+    double high = key + _angleThreshold;
+
+    /*
+     * The first index whose angle is > bound, and the first index whose angle is >= bound.
+     */
+    auto above = [this](double bound) {
+        return int(upper_bound(_angles.begin(), _angles.end(), bound,
+                               [](double b, float other) { return b < other; }) - _angles.begin());
+    };
+    auto notBelow = [this](double bound) {
+        return int(lower_bound(_angles.begin(), _angles.end(), bound,
+                               [](float other, double b) { return other < b; }) - _angles.begin());
+    };
+
+    window.add(above(low), notBelow(high) - 1);
+
+    /*
+     * The threshold is below 180°, so at most one side of the window wraps
+     * and the wrapped range can't overlap the main one.
+     */
+    if (low < 0)
+        window.add(above(low + 360), size() - 1);
+    else if (high > 360)
+        window.add(0, notBelow(high - 360) - 1);
+
+    return window;
+}
+
+/**
+ * Given the i-th keypoint, computes the indices of a window
+ * around it containing only points whose descriptor's norm is not further
+ * from its own by __normWindow_.
+ *
+ * @param i     The index of the keypoint we want a window around.
+ *
+ * @return  A pair of indices representing the window [_minIdx_, _maxIdx_] in the norm order.
+ */
+pair<int, int> InterestPoints::getRangeNorm(int i) const {
+    return getSortedRange(_sortedNorms, _normIdx[i], _normWindow);
+}
+
+
+/**
+ * This function actually computes the [minIdx, maxIdx] window described in
+ * InterestPoints::getRangeNorm(int) const. The bounds of the window are found
+ * by binary search.
+ *
+ * @param keys          The **SORTED** keys from which the window will be selected.
+ * @param i             The index of the keypoint at the center of the window in _keys_.
+ * @param threshold     The threshold from which a point will not be selected.
+ *
+ * @return  A window [minIdx, maxIdx] around the _i_-th key such as:
+ *
+ *          \f$ \forall j \in [\mathrm{minIdx}, \mathrm{maxIdx}], |keys[i] - keys[j]| < \mathrm{threshold}\f$
+ */
+pair<int, int> InterestPoints::getSortedRange(const vector<float>& keys, int i, double threshold) const {
+    double key = keys[i];
+
+    auto first = upper_bound(keys.begin(), keys.end(), key - threshold,
+                             [](double bound, float other) { return bound < other; });
+    auto last = lower_bound(keys.begin(), keys.end(), key + threshold,
+                            [](float other, double bound) { return other < bound; });
+
+    return make_pair(first - keys.begin(), last - keys.begin() - 1);
+}
+
+pair<int, int> InterestPoints::getRelativeRangeNorm(int center, int end) const {
+    int centerIdx = _normIdx[center];
+    int endIdx = _normIdx[end];
 
     int minIdx, maxIdx;
     if (endIdx < centerIdx) {
@@ -340,12 +1543,33 @@ pair<int, int> InterestPoints::getRelativeRangeNorm(const InterestPoint& center,
     if (maxIdx >= size())
         maxIdx = size() - 1;
 
-    /*
-    pair<int, int>&& before = getRangeNorm(*_pointsSortedNorm[minIdx]);
-    pair<int, int>&& after = getRangeNorm(*_pointsSortedNorm[maxIdx]);
+    return make_pair(minIdx, maxIdx);
+}
 
-    return make_pair(before.first, after.second);
-     */
+/**
+ * @param angle     An angle in degrees, in [0, 360[.
+ *
+ * @return  The index of the cell containing _angle_ along the angle axis of the grid.
+ */
+int InterestPoints::angleCell(float angle) const {
+    return min(max((int) (angle / _cellAngle), 0), _gridAngles - 1);
+}
 
-    return make_pair(minIdx, maxIdx);
+/**
+ * @param norm      The norm of a descriptor.
+ *
+ * @return  The index of the cell containing _norm_ along the norm axis of the grid.
+ */
+int InterestPoints::normCell(float norm) const {
+    if (_cellNorm <= 0)
+        return 0;
+
+    return min(max((int) ((norm - _minNorm) / _cellNorm), 0), _gridNorms - 1);
+}
+
+/**
+ * @return  The index of a cell of the grid from its indices along each axis.
+ */
+int InterestPoints::gridCell(int angleCell, int normCell, int octaveCell) const {
+    return (angleCell * _gridNorms + normCell) * _gridOctaves + octaveCell;
 }
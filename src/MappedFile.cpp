@@ -0,0 +1,157 @@
+#include "../include/MappedFile.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace defals;
+
+/**
+ * @return  The size of a memory page in bytes.
+ */
+static size_t pageSize() {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/**
+ * Creates a temporary file of _size_ bytes in _directory_ and maps it in memory.
+ * The program exits if the file can't be created or mapped.
+ *
+ * @param directory     The directory the file is created in.
+ * @param size          The size of the file in bytes.
+ */
+MappedFile::MappedFile(const string& directory, size_t size) : _data(nullptr), _size(size), _fd(-1), _released(0) {
+    string path = directory + "/copyMoveCheck-XXXXXX";
+    _fd = mkstemp(&path[0]);
+    if (_fd < 0) {
+        cerr << "Couldn't create a file in " << directory << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+    unlink(path.c_str());
+
+    if (_size == 0)
+        return;
+
+    if (ftruncate(_fd, _size) != 0) {
+        cerr << "Couldn't allocate " << _size << " bytes in " << directory << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+
+    _data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (_data == MAP_FAILED) {
+        cerr << "Couldn't map " << path << ": " << strerror(errno) << endl;
+        exit(1);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (_data)
+        munmap(_data, _size);
+    if (_fd >= 0)
+        close(_fd);
+}
+
+/**
+ * Writes the modified pages to the file and gives them back, so that
+ * the system can drop them from memory instead of keeping them dirty.
+ */
+void MappedFile::flush() const {
+    if (!_data)
+        return;
+
+    msync(_data, _size, MS_SYNC);
+    madvise(_data, _size, MADV_DONTNEED);
+}
+
+/**
+ * Tells the system that the bytes in [_from_, _to_[ are going to be read soon.
+ */
+void MappedFile::prefetch(size_t from, size_t to) const {
+    to = min(to, _size);
+    from -= from % pageSize();
+    if (!_data || from >= to)
+        return;
+
+    madvise((char *) _data + from, to - from, MADV_WILLNEED);
+}
+
+/**
+ * Gives back the pages holding the bytes in [_from_, _to_[, which aren't going to be read
+ * anymore. Pages already released since the construction of the file are skipped, and
+ * the pages straddling a bound are kept.
+ *
+ * Releasing is only a hint: a released page that is read again is loaded back from the file.
+ */
+void MappedFile::release(size_t from, size_t to) {
+    to = min(to, _size);
+    to -= to % pageSize();
+
+    size_t released = _released.load();
+    do {
+        if (to <= released)
+            return;
+    } while (!_released.compare_exchange_weak(released, to));
+
+    from = max(from, released);
+    from = (from + pageSize() - 1) / pageSize() * pageSize();
+    if (_data && from < to)
+        madvise((char *) _data + from, to - from, MADV_DONTNEED);
+}
+
+/**
+ * Writes the modified pages holding the bytes in [_from_, _to_[ to the file and gives
+ * them back, whether they were released before or not. Unlike MappedFile::release, the
+ * range doesn't have to move forward: it is used to bound the memory taken while the
+ * file is written or read out of order.
+ *
+ * The pages straddling a bound are given back too, and are loaded back from the file
+ * if they're read again.
+ */
+void MappedFile::evict(size_t from, size_t to) const {
+    to = min(to, _size);
+    from -= from % pageSize();
+    if (!_data || from >= to)
+        return;
+
+    msync((char *) _data + from, to - from, MS_SYNC);
+    madvise((char *) _data + from, to - from, MADV_DONTNEED);
+}
+
+/**
+ * Copies _size_ bytes of the file from _offset_ into _buffer_, without going through
+ * the mapping. Reading the file at random through the mapping maps whole runs of pages
+ * around each byte read: the memory taken then grows up to the size of the file even
+ * though little of it is read. The program exits if the file can't be read.
+ *
+ * @param offset    The offset of the first byte.
+ * @param buffer    The memory the bytes are copied to.
+ * @param size      The number of bytes.
+ */
+void MappedFile::read(size_t offset, void *buffer, size_t size) const {
+    char *destination = (char *) buffer;
+    while (size > 0) {
+        ssize_t count = pread(_fd, destination, size, offset);
+        if (count <= 0) {
+            cerr << "Couldn't read the temporary file: " << (count < 0 ? strerror(errno) : "unexpected end of file") << endl;
+            exit(1);
+        }
+        destination += count;
+        offset += count;
+        size -= count;
+    }
+}
+
+void *MappedFile::data() const {
+    return _data;
+}
+
+size_t MappedFile::size() const {
+    return _size;
+}
@@ -0,0 +1,42 @@
+#include "../include/Segment.hpp"
+
+#include <cmath>
+
+using namespace std;
+using namespace cv;
+using namespace defals;
+
+/**
+ * Constructs the segment from _start_ to _end_.
+ *
+ * The polar angle is computed the same way as Line::getTheta: it is the angle of the
+ * orthogonal projection of the origin on the line.
+ *
+ * @param start     The start point.
+ * @param end       The end point.
+ * @param point1    The index of the start keypoint in the angle order.
+ * @param point2    The index of the end keypoint in the angle order.
+ *
+ * @return  The segment.
+ */
+Segment Segment::between(const Point2f& start, const Point2f& end, int point1, int point2) {
+    double a = start.y - end.y;
+    double b = end.x - start.x;
+    double c = -a * start.x - b * start.y;
+
+    double squaredNorm = a * a + b * b;
+    double xN = -a * c / squaredNorm;
+    double yN = -b * c / squaredNorm;
+
+    Segment segment;
+    segment.x1 = start.x;
+    segment.y1 = start.y;
+    segment.x2 = end.x;
+    segment.y2 = end.y;
+    segment.theta = (float) atan2(yN, xN);
+    segment.length = (float) norm(start - end);
+    segment.point1 = point1;
+    segment.point2 = point2;
+
+    return segment;
+}
@@ -0,0 +1,201 @@
+#include "../include/Shard.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+
+#include <unistd.h>
+
+using namespace std;
+using namespace cv;
+using namespace defals;
+
+/**
+ * Builds the shard owning the keypoints in [_first_, _last_[ of the angle order.
+ *
+ * The main ranges of consecutive keypoints move forward together, so their union is
+ * a single range. The ranges found by going around 360° are at the start or at the end
+ * of the angle order, so each end only needs its widest range.
+ *
+ * The grid window ignores the candidate cap: its halo is built from the uncapped angle
+ * windows, which hold every keypoint of the grid window.
+ *
+ * @param points    The keypoints.
+ * @param first     The first owned keypoint.
+ * @param last      The keypoint following the last owned keypoint.
+ * @param window    The kind of window the worker matches with: ANGLE or GRID.
+ *
+ * @return  The shard.
+ */
+Shard defals::makeShard(const InterestPoints& points, int first, int last, MatchingWindow window) {
+    const int n = points.size();
+
+    vector<pair<int, int>> spans;
+    int headLast = -1, tailFirst = n;
+    for (int i = first; i < last; i++) {
+        AngleWindow angles = window == MatchingWindow::GRID ? points.getUncappedRangeAngle(i)
+                                                            : points.getRangeAngle(i);
+        for (int r = 0; r < angles.nbRanges; r++) {
+            const pair<int, int>& range = angles.ranges[r];
+            if (range.first <= i && i <= range.second)
+                spans.push_back(range);
+            else if (range.second < i)
+                headLast = max(headLast, range.second);
+            else
+                tailFirst = min(tailFirst, range.first);
+        }
+    }
+    spans.emplace_back(first, last - 1);
+    if (headLast >= 0)
+        spans.emplace_back(0, headLast);
+    if (tailFirst < n)
+        spans.emplace_back(tailFirst, n - 1);
+
+    std::sort(spans.begin(), spans.end());
+    Shard shard;
+    int next = 0;
+    for (const auto& span : spans) {
+        for (int i = max(span.first, next); i <= span.second; i++)
+            shard.indices.push_back(i);
+        next = max(next, span.second + 1);
+    }
+
+    shard.ownedFirst = lower_bound(shard.indices.begin(), shard.indices.end(), first) - shard.indices.begin();
+    shard.ownedLast = shard.ownedFirst + (last - first);
+    shard.angleThreshold = points.angleThreshold();
+    shard.normWindow = points.normWindow();
+
+    return shard;
+}
+
+/**
+ * Writes _size_ bytes to _fd_, the program exits if it fails.
+ */
+static void writeAll(int fd, const void *data, size_t size) {
+    const char *bytes = (const char *) data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0) {
+            cerr << "Couldn't write to worker pipe" << endl;
+            exit(1);
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+/**
+ * Reads _size_ bytes from _fd_.
+ *
+ * @return  False if the pipe was closed or an error occurred before all the bytes were read.
+ */
+static bool readAll(int fd, void *data, size_t size) {
+    char *bytes = (char *) data;
+    while (size > 0) {
+        ssize_t got = read(fd, bytes, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        bytes += got;
+        size -= got;
+    }
+
+    return true;
+}
+
+/**
+ * Sends a shard to a worker: the range it owns and the thresholds of the windows, then
+ * the position, size, angle, octave, response and descriptor of each of its keypoints.
+ *
+ * @param fd        The pipe to the worker.
+ * @param points    The keypoints.
+ * @param shard     The shard to send.
+ */
+void defals::writeShard(int fd, const InterestPoints& points, const Shard& shard) {
+    int header[4] = { (int) shard.indices.size(), points.descriptorSize(), shard.ownedFirst, shard.ownedLast };
+    double thresholds[2] = { shard.angleThreshold, shard.normWindow };
+    writeAll(fd, header, sizeof(header));
+    writeAll(fd, thresholds, sizeof(thresholds));
+    writeAll(fd, shard.indices.data(), shard.indices.size() * sizeof(int));
+
+    for (int i : shard.indices) {
+        float keypoint[6] = { points.pt(i).x, points.pt(i).y, points.keypointSize(i), points.angle(i),
+                              (float) points.octave(i), points.response(i) };
+        writeAll(fd, keypoint, sizeof(keypoint));
+        writeAll(fd, points.descriptor(i), points.descriptorSize() * sizeof(float));
+    }
+}
+
+/**
+ * Receives a shard sent by defals::writeShard.
+ *
+ * The keypoints are given in the angle order, their descriptors being the rows of _descriptors_.
+ *
+ * @param fd            The pipe from the coordinator.
+ * @param shard         The indices of the keypoints of the shard and the range it owns.
+ * @param keypoints     The keypoints of the shard.
+ * @param descriptors   The descriptors of the keypoints of the shard.
+ *
+ * @return  False if the shard couldn't be read.
+ */
+bool defals::readShard(int fd, Shard& shard, vector<KeyPoint>& keypoints, Mat& descriptors) {
+    int header[4];
+    double thresholds[2];
+    if (!readAll(fd, header, sizeof(header)) || !readAll(fd, thresholds, sizeof(thresholds)))
+        return false;
+
+    int n = header[0];
+    shard.ownedFirst = header[2];
+    shard.ownedLast = header[3];
+    shard.angleThreshold = thresholds[0];
+    shard.normWindow = thresholds[1];
+    shard.indices.resize(n);
+    if (!readAll(fd, shard.indices.data(), n * sizeof(int)))
+        return false;
+
+    keypoints.clear();
+    descriptors.create(n, header[1], CV_32F);
+    for (int k = 0; k < n; k++) {
+        float keypoint[6];
+        if (!readAll(fd, keypoint, sizeof(keypoint)) ||
+            !readAll(fd, descriptors.ptr<float>(k), header[1] * sizeof(float)))
+            return false;
+
+        keypoints.emplace_back(Point2f(keypoint[0], keypoint[1]), keypoint[2], keypoint[3], keypoint[5],
+                               (int) keypoint[4]);
+    }
+
+    return true;
+}
+
+/**
+ * Sends the matches found by a worker to the coordinator.
+ *
+ * @param fd        The pipe to the coordinator.
+ * @param matches   The matches.
+ */
+void defals::writeMatches(int fd, const vector<Match>& matches) {
+    int n = matches.size();
+    writeAll(fd, &n, sizeof(n));
+    writeAll(fd, matches.data(), n * sizeof(Match));
+}
+
+/**
+ * Receives the matches sent by defals::writeMatches.
+ *
+ * @param fd        The pipe from a worker.
+ * @param matches   The matches.
+ *
+ * @return  False if the matches couldn't be read.
+ */
+bool defals::readMatches(int fd, vector<Match>& matches) {
+    int n;
+    if (!readAll(fd, &n, sizeof(n)))
+        return false;
+
+    matches.assign(n, Match(0, 0, 0));
+    return readAll(fd, matches.data(), n * sizeof(Match));
+}
@@ -0,0 +1,71 @@
+#include "../include/WorkQueue.hpp"
+
+#include <algorithm>
+
+using namespace std;
+using namespace defals;
+
+/**
+ * Constructs a queue handing out the indices [_first_, _last_[.
+ *
+ * @param first         The first index.
+ * @param last          The index following the last index.
+ * @param nbThreads     The number of threads sharing the queue.
+ * @param granularity   Chunks are multiples of this number, except for the last one.
+ */
+WorkQueue::WorkQueue(int first, int last, int nbThreads, int granularity) : _next(first),
+                                                                           _last(last),
+                                                                           _nbThreads(max(nbThreads, 1)),
+                                                                           _granularity(max(granularity, 1)) {
+}
+
+/**
+ * Takes the next chunk of indices.
+ *
+ * @param count     The number of indices wanted.
+ * @param first     The first index of the chunk.
+ * @param last      The index following the last index of the chunk.
+ *
+ * @return  False if all the indices have already been handed out, true otherwise.
+ */
+bool WorkQueue::take(int count, int &first, int &last) {
+    first = _next.fetch_add(count, memory_order_relaxed);
+    if (first >= _last)
+        return false;
+
+    last = min(first + count, _last);
+    return true;
+}
+
+/**
+ * Computes the size of the next chunk of a thread.
+ *
+ * @param count     The size of the last chunk of the thread.
+ * @param seconds   The time the last chunk took.
+ *
+ * @return  The number of indices the thread should take next.
+ */
+int WorkQueue::chunkSize(int count, double seconds) const {
+    /*
+     * The size can at most double from one chunk to the next,
+     * so that a single cheap chunk doesn't make the thread take a huge one.
+     */
+    double wanted = 2.0 * count;
+    if (seconds > 0)
+        wanted = min(wanted, count * TARGET_SECONDS / seconds);
+
+    int remaining = _last - _next.load(memory_order_relaxed);
+    double guided = remaining / (2.0 * _nbThreads);
+
+    int chunk = (int) min(wanted, guided);
+    chunk = (chunk / _granularity) * _granularity;
+
+    return max(chunk, _granularity);
+}
+
+/**
+ * @return  The number chunk sizes are a multiple of. It is also the size of the first chunk.
+ */
+int WorkQueue::granularity() const {
+    return _granularity;
+}
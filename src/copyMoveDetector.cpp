@@ -4,6 +4,12 @@
 
 #include "../include/copyMoveDetector.hpp"
 
+#include <cerrno>
+#include <cstring>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
 using namespace std;
 using namespace cv;
 using namespace cv::xfeatures2d;
@@ -20,6 +26,8 @@ using namespace defals;
  *       - matchesThreshold should be a constant as specified in the research paper.
  *         We need to check though whether 0.5 is a good enough value.
  *
+ * The worker processes of sharded matching are started first, before the image is read.
+ *
  * @param filename          The name of the image file.
  * @param masqueName        The name of the falsification binary mask.
  *                          Can be empty.
@@ -29,6 +37,9 @@ using namespace defals;
 copyMoveDetector::copyMoveDetector(const DetectorOptions& options) : _options(options) {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _copyMoveDetector_ constructor";
 
+    if (_options.workers > 0 && shardable())
+        startWorkers();
+
     BOOST_LOG_TRIVIAL(debug) << "Reading file " << options.image;
     _image = cv::imread(options.image, cv::IMREAD_COLOR);
     if (_image.empty()) {
@@ -97,7 +108,7 @@ void copyMoveDetector::detect() {
  */
 [[deprecated]] void copyMoveDetector::printLines() const {
     for (const auto& line : _lines) {
-        cerr << line << endl;
+        cerr << Line(line) << endl;
     }
 }
 
@@ -111,7 +122,7 @@ void copyMoveDetector::detect() {
     cout << n << endl;
     for (int i = 0; i < n; i++) {
         for (const auto& line : _clusters[i])
-            cout << i << ',' << line << endl;
+            cout << i << ',' << Line(_lines[line]) << endl;
     }
 }
 
@@ -130,27 +141,21 @@ void copyMoveDetector::detect() {
 
     for (const auto& cluster : _clusters) {
         for (const auto &line : cluster) {
-            const InterestPoint &start = line.getPoint1();
-            const InterestPoint &end = line.getPoint2();
-
-            int idx1 = start.getAngleIdx();
-            int idx2 = end.getAngleIdx();
+            int idx1 = _lines[line].point1;
+            int idx2 = _lines[line].point2;
 
-            double angleDiff = start.angle - end.angle;
-            double normDiff = norm(start.getDescriptor()) - norm(end.getDescriptor());
+            double angleDiff = _interestPoints.angle(idx1) - _interestPoints.angle(idx2);
+            double normDiff = _interestPoints.descriptorNorm(idx1) - _interestPoints.descriptorNorm(idx2);
             cout << "cluster," << idx1 << "," << idx2 << "," << angleDiff << "," << normDiff << endl;
         }
     }
 
     for (const auto& line : _lines) {
-        const InterestPoint &start = line.getPoint1();
-        const InterestPoint &end = line.getPoint2();
+        int idx1 = line.point1;
+        int idx2 = line.point2;
 
-        int idx1 = start.getAngleIdx();
-        int idx2 = end.getAngleIdx();
-
-        double angleDiff = start.angle - end.angle;
-        double normDiff = norm(start.getDescriptor()) - norm(end.getDescriptor());
+        double angleDiff = _interestPoints.angle(idx1) - _interestPoints.angle(idx2);
+        double normDiff = _interestPoints.descriptorNorm(idx1) - _interestPoints.descriptorNorm(idx2);
         cout << idx1 << "," << idx2 << "," << angleDiff << "," << normDiff << endl;
     }
 }
@@ -202,7 +207,8 @@ void copyMoveDetector::show() const {
     if (_options.draw_matches) {
         BOOST_LOG_TRIVIAL(debug) << "Drawing matches";
         Mat lines_canvas = _image.clone();
-        for (const auto &line : _lines) {
+        for (const auto &segment : _lines) {
+            Line line(segment);
             line.draw(lines_canvas, Scalar(0), 1);
             if (!_options.mask.empty())
                 line.draw(dst_mask, Scalar(0xFF, 0xFF, 0xFF), 1);
@@ -223,7 +229,8 @@ void copyMoveDetector::show() const {
 
             BOOST_LOG_TRIVIAL(trace) << "Cluster n°" << i << "'s color: " << R << " " << G << " " << B;
 
-            for (const auto& line : cluster) {
+            for (const auto& index : cluster) {
+                Line line(_lines[index]);
                 line.draw(cluster_canvas, color, 1);
                 if (!_options.mask.empty())
                     line.draw(dst_mask, color, 1);
@@ -243,7 +250,7 @@ void copyMoveDetector::show() const {
         for (const auto& hull : _hulls) {
             vector<Point> pts;
             for (const auto& pt : hull) {
-                pts.push_back(pt.first.pt);
+                pts.push_back(pt.first);
             }
             hullsList.push_back(pts);
         }
@@ -293,71 +300,310 @@ inline void copyMoveDetector::save(const Mat &img, const std::string& filename)
 /**
  * This function applies the SURF algorithm in order to
  * find keypoints for the image.
+ *
+ * If a tile size is given, the extraction is done by
+ * computeTiledKeypoints on several threads instead of a single pass
+ * over the whole image.
+ *
+ * When the descriptors are spilled, the memory they take follows the matching window
+ * rather than the number of keypoints, with a few exceptions:
+ *  - a single SURF pass holds all the descriptors in memory until they're copied to the
+ *    file, only the tiled extraction streams them;
+ *  - a few tens of bytes per keypoint stay in memory (position, angle, norm...), plus the
+ *    compact descriptors and projections when they're enabled, and the grid and the
+ *    approximate index when they're built;
+ *  - the windows other than the exact angle window may read the whole file.
  */
 void copyMoveDetector::computeKeypoints() {
     BOOST_LOG_TRIVIAL(info) << "Entering _computeKeypoints_";
 
-    BOOST_LOG_TRIVIAL(debug) << "Creating SURF detector with minHessian = " << _options.kp_hessian;
-    Ptr<SURF> detector = SURF::create(_options.kp_hessian);
     vector<KeyPoint> keypoints;
-    detector->detect(_image, keypoints);
-
     Mat descriptors;
-    detector->compute(_image, keypoints, descriptors);
-    _interestPoints = InterestPoints(keypoints, descriptors, _options.g2NN_angleThreshold, _options.g2NN_normThreshold);
+    shared_ptr<MappedFile> tiledDescriptors;
+    if (_options.kp_tile > 0) {
+        computeTiledKeypoints(keypoints, descriptors, tiledDescriptors);
+    }
+    else {
+        if (!_options.g2NN_spill.empty())
+            BOOST_LOG_TRIVIAL(warning) << "Without tiles, SURF keeps all the descriptors in memory before they're "
+                                          "spilled: use --tile to stream them to the file";
+        BOOST_LOG_TRIVIAL(debug) << "Creating SURF detector with minHessian = " << _options.kp_hessian;
+        Ptr<SURF> detector = SURF::create(_options.kp_hessian);
+        detector->detectAndCompute(_image, Mat(), keypoints, descriptors);
+    }
+    _interestPoints = InterestPoints(keypoints, descriptors,
+                                     _options.g2NN_angleThreshold, _options.g2NN_normThreshold,
+                                     _options.jobs, _options.g2NN_spill, tiledDescriptors.get());
+
+    /*
+     * The interest points have their own copy: the keypoints and descriptors of the
+     * detector are given back before the passes below.
+     */
+    vector<KeyPoint>().swap(keypoints);
+    descriptors.release();
+    tiledDescriptors.reset();
+
+    _interestPoints.setMinSeparation(_options.g2NN_separation);
+    _interestPoints.setCandidateCap(_options.g2NN_cap);
+    _interestPoints.buildCompactDescriptors(_options.g2NN_storage);
+    if (!_options.g2NN_pcaFile.empty())
+        _interestPoints.loadProjection(_options.g2NN_pcaFile);
+    else if (_options.g2NN_pca > 0)
+        _interestPoints.learnProjection(_options.g2NN_pca);
+    tuneWindows();
+    if (_options.g2NN_window == MatchingWindow::GRID)
+        _interestPoints.buildGrid(_options.g2NN_octaveThreshold);
+    if (_options.g2NN_ann) {
+        BOOST_LOG_TRIVIAL(debug) << "Building approximate index with " << _options.g2NN_annTrees << " trees";
+        _interestPoints.buildIndex(_options.g2NN_annTrees);
+    }
 
     BOOST_LOG_TRIVIAL(debug) << "Computed " << _interestPoints.size() << " keypoints";
 
     BOOST_LOG_TRIVIAL(info) << "Leaving _computeKeypoints_";
 }
 
+/**
+ * If a candidate budget is given, tunes the threshold of the matching window so
+ * that windows hold about that many keypoints. The half-width of the norm windows is
+ * tuned for the norm window, the angle threshold for the angle window.
+ *
+ * The grid window is the intersection of an angle window and a norm window, whose
+ * selectivities multiply: both are tuned to \f$\sqrt{budget \cdot n}\f$ keypoints, so
+ * that their intersection holds about _budget_ keypoints.
+ *
+ * A tuned angle threshold replaces the one of the options, and statistics of the
+ * resulting window sizes are logged.
+ */
+void copyMoveDetector::tuneWindows() {
+    /*
+     * The number of keypoints whose windows are measured.
+     */
+    static const int SAMPLES = 1000;
+
+    if (_options.g2NN_budget > 0) {
+        int budget = _options.g2NN_budget;
+        if (_options.g2NN_window == MatchingWindow::GRID)
+            budget = (int) ceil(sqrt((double) budget * _interestPoints.size()));
+
+        if (_options.g2NN_window != MatchingWindow::ANGLE) {
+            double normWindow = _interestPoints.tuneNormWindow(budget, SAMPLES);
+            BOOST_LOG_TRIVIAL(info) << "Tuned norm window: " << normWindow
+                                    << ", candidates' norms still limited to " << _interestPoints.normThreshold();
+        }
+        if (_options.g2NN_window != MatchingWindow::NORM) {
+            _options.g2NN_angleThreshold = _interestPoints.tuneAngleThreshold(budget, SAMPLES);
+            BOOST_LOG_TRIVIAL(info) << "Tuned angle threshold: " << _options.g2NN_angleThreshold;
+        }
+    }
+
+    vector<int> sizes = _interestPoints.sampleWindowSizes(_options.g2NN_window, SAMPLES);
+    if (sizes.empty())
+        return;
+
+    double mean = accumulate(sizes.begin(), sizes.end(), 0.0) / sizes.size();
+    BOOST_LOG_TRIVIAL(info) << "Window sizes over " << sizes.size() << " keypoints: min " << sizes.front()
+                            << ", median " << sizes[sizes.size() / 2] << ", mean " << mean
+                            << ", 90th percentile " << sizes[sizes.size() * 9 / 10] << ", max " << sizes.back();
+}
+
+/**
+ * Computes the overlap needed between two tiles so that a keypoint detected
+ * in the core of a tile gets the same position, orientation and descriptor as
+ * in a single pass over the whole image.
+ *
+ * The largest box filter of the detector must fit around the keypoint, and so
+ * must its descriptor window, which is a 20s x 20s square rotated by the
+ * keypoint's orientation (s being the keypoint's scale).
+ *
+ * @param detector  The SURF detector used on every tile.
+ *
+ * @return  The margin in pixels.
+ */
+static int surfMargin(const SURF& detector) {
+    int largestFilter = (9 + 6 * (detector.getNOctaveLayers() + 1)) << (detector.getNOctaves() - 1);
+    double largestScale = 1.2 * largestFilter / 9.0;
+
+    return (int) ceil(largestFilter / 2.0 + 10 * sqrt(2) * largestScale);
+}
+
+/**
+ * This function does the same work as a single SURF pass, but splits the image in
+ * tiles of _kp_tile_ x _kp_tile_ pixels that are processed by _jobs_ threads.
+ *
+ * Each tile is extended by a margin on every side before running SURF on it, so that
+ * the keypoints of the tile's core see the same neighbourhood as in the whole image.
+ * A keypoint detected in the margin of a tile also belongs to the core of a neighbouring
+ * tile: it is only kept by the tile whose core contains it, which removes the duplicates
+ * before their descriptors are computed.
+ *
+ * SURF samples the o-th octave every 2^o pixels from the origin of the image it is given:
+ * the extended tiles start on a multiple of the sampling step of the last octave, so that
+ * every octave is sampled on the same grid as in the whole image.
+ *
+ * The keypoints of every tile are detected first, which gives the rows of each tile in the
+ * descriptors matrix. The descriptors are then computed tile by tile and written straight
+ * to their rows: if the descriptors are spilled, the matrix is mapped on a temporary file
+ * and the rows of a tile are given back to the system once written, so that only the
+ * tiles being processed are resident.
+ *
+ * @param keypoints     The keypoints of the whole image, in image coordinates.
+ * @param descriptors   The descriptors of the keypoints such as line i is the i-th keypoint's descriptor.
+ * @param file          The file _descriptors_ is mapped on if the descriptors are spilled, nullptr otherwise.
+ */
+void copyMoveDetector::computeTiledKeypoints(vector<KeyPoint>& keypoints, Mat& descriptors,
+                                             shared_ptr<MappedFile>& file) const {
+    BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeTiledKeypoints_";
+
+    const int tile = _options.kp_tile;
+    Ptr<SURF> reference = SURF::create(_options.kp_hessian);
+    const int step = 1 << (reference->getNOctaves() - 1);
+    const int dim = reference->descriptorSize();
+    int margin = _options.kp_tileMargin >= 0 ? _options.kp_tileMargin : surfMargin(*reference);
+    margin = (margin + step - 1) / step * step;
+
+    vector<Rect> cores;
+    for (int y = 0; y < _image.rows; y += tile) {
+        for (int x = 0; x < _image.cols; x += tile)
+            cores.emplace_back(x, y, min(tile, _image.cols - x), min(tile, _image.rows - y));
+    }
+
+    const int nbThreads = min<int>(_options.jobs, cores.size());
+    BOOST_LOG_TRIVIAL(debug) << "Detecting keypoints on " << cores.size() << " tiles of " << tile << "x" << tile
+                             << " pixels (margin: " << margin << " pixels) with " << nbThreads << " threads";
+
+    auto extendedTile = [&](const Rect& core) {
+        int x0 = max(core.x - margin, 0) / step * step;
+        int y0 = max(core.y - margin, 0) / step * step;
+        int x1 = min(core.x + core.width + margin, _image.cols);
+        int y1 = min(core.y + core.height + margin, _image.rows);
+        return Rect(x0, y0, x1 - x0, y1 - y0);
+    };
+
+    auto runTiles = [&](const function<void(SURF&, size_t)>& process) {
+        atomic<size_t> nextTile(0);
+        auto run = [&]() {
+            Ptr<SURF> detector = SURF::create(_options.kp_hessian);
+            for (size_t t = nextTile++; t < cores.size(); t = nextTile++)
+                process(*detector, t);
+        };
+
+        vector<thread> threads;
+        for (int noThread = 0; noThread < nbThreads; noThread++)
+            threads.emplace_back(run);
+        for (auto& t : threads)
+            t.join();
+    };
+
+    /*
+     * Keypoints are kept in the extended tile's coordinates until their descriptors are computed.
+     */
+    vector<vector<KeyPoint>> tilesKeypoints(cores.size());
+    runTiles([&](SURF& detector, size_t t) {
+        const Rect& core = cores[t];
+        Rect extended = extendedTile(core);
+
+        vector<KeyPoint> detected;
+        detector.detect(_image(extended), detected);
+
+        for (const auto& keypoint : detected) {
+            float x = keypoint.pt.x + extended.x;
+            float y = keypoint.pt.y + extended.y;
+            if (x >= core.x && x < core.x + core.width &&
+                y >= core.y && y < core.y + core.height)
+                tilesKeypoints[t].push_back(keypoint);
+        }
+    });
+
+    /*
+     * Tiles are given their rows in their creation order so that the result
+     * doesn't depend on which thread processed which tile.
+     */
+    vector<int> offsets(cores.size() + 1, 0);
+    for (size_t t = 0; t < cores.size(); t++)
+        offsets[t + 1] = offsets[t] + tilesKeypoints[t].size();
+
+    const int total = offsets.back();
+    if (total > 0 && !_options.g2NN_spill.empty()) {
+        file = make_shared<MappedFile>(_options.g2NN_spill, (size_t) total * dim * sizeof(float));
+        descriptors = Mat(total, dim, CV_32F, file->data());
+    }
+    else
+        descriptors.create(total, dim, CV_32F);
+
+    runTiles([&](SURF& detector, size_t t) {
+        if (tilesKeypoints[t].empty())
+            return;
+
+        Rect extended = extendedTile(cores[t]);
+        Mat tileDescriptors;
+        detector.compute(_image(extended), tilesKeypoints[t], tileDescriptors);
+
+        int count = tilesKeypoints[t].size();
+        if (count > 0)
+            tileDescriptors.copyTo(descriptors.rowRange(offsets[t], offsets[t] + count));
+        if (file)
+            file->evict((size_t) offsets[t] * descriptors.step, (size_t) (offsets[t] + count) * descriptors.step);
+
+        for (auto& keypoint : tilesKeypoints[t]) {
+            keypoint.pt.x += extended.x;
+            keypoint.pt.y += extended.y;
+        }
+    });
+
+    /*
+     * SURF drops the keypoints whose descriptor can't be computed: the rows of the
+     * following tiles are moved up over the rows left empty.
+     */
+    int kept = 0;
+    for (size_t t = 0; t < cores.size(); t++) {
+        int count = tilesKeypoints[t].size();
+        if (kept != offsets[t] && count > 0) {
+            for (int first = 0; first < count; first += InterestPoints::SPILL_CHUNK) {
+                int last = min(count, first + InterestPoints::SPILL_CHUNK);
+                memmove(descriptors.ptr(kept + first), descriptors.ptr(offsets[t] + first),
+                        (last - first) * descriptors.step);
+                if (file)
+                    file->evict((size_t) (kept + first) * descriptors.step,
+                                (size_t) (offsets[t] + last) * descriptors.step);
+            }
+        }
+
+        keypoints.insert(keypoints.end(), tilesKeypoints[t].begin(), tilesKeypoints[t].end());
+        vector<KeyPoint>().swap(tilesKeypoints[t]);
+        kept += count;
+    }
+    descriptors = descriptors.rowRange(0, kept);
+
+    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeTiledKeypoints_";
+}
+
 
 /**
  * This function computes matches for a specific keypoint.
  * It calls _similarityVector_ in order to compute the similarity
- * vector for keypoint _i_ then adds to allMatches the matched keypoints.
+ * vector for keypoint _i_ then adds to _matches_ the matched keypoints.
  *
- * @param i     The index of the source keypoint in _keypoints.
+ * @param i         The index of the source keypoint in _keypoints.
+ * @param matches   The matches found by the calling thread.
  */
-void copyMoveDetector::computeMatch(int i) {
+void copyMoveDetector::computeMatch(int i, vector<Match>& matches) const {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeMatch_";
 
     BOOST_LOG_TRIVIAL(trace) << "Computing match for keypoint n°" << i;
-    map<double, InterestPoint>&& similarity = _interestPoints.similarityAngle(_interestPoints[i]);
-
-    map<double, InterestPoint>::iterator it1;
-    map<double, InterestPoint>::iterator it2;
-    vector<InterestPoint> matches;
+    G2NNCollector candidates;
+    _interestPoints.similarityAngle(i, candidates);
 
     /*
-     * Here, the similarity vector should be sorted by ascending order.
-     * Thus, we iterate over it with two iterators and we compare the
-     * euclidean distances. Mathematically, we have a vector
+     * Here, the candidates are sorted by ascending order. Mathematically,
+     * we have a vector
      *              D = {d1, ..., d_n}
      * and we check for i in [1, n-1] :
      *              di / di+1 < T
+     * This version only keeps the first match.
      */
-    for (it1 = similarity.begin(),
-         it2 = next(it1);
-         it1 != similarity.end() && it2 != similarity.end();
-         it1++, it2++) {
-        double distance1 = it1->first;
-        double distance2 = it2->first;
-        if (distance1 / distance2 < 0.5 && it1->second.getAngleIdx() != i) {
-            InterestPoint& possibleMatch = it1->second;
-            int j = possibleMatch.getAngleIdx();
-            /*
-             * First we check that the match hasn't already been computed.
-             */
-            if (find(_allMatches[j].begin(), _allMatches[j].end(), _interestPoints[i]) == _allMatches[j].end())
-                matches.push_back(possibleMatch);
-            break;
-        }
-        else
-            break;
-    }
-
-    _allMatches[i] = matches;
+    if (candidates.nbMatches() > 0)
+        matches.emplace_back(i, candidates.index(0), candidates.distance(0));
 
     BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeMatch_";
 }
@@ -367,132 +613,424 @@ void copyMoveDetector::computeMatch(int i) {
  * It isn't part of the class because it is going to be called by
  * a thread and a thread can't call a member function.
  *
- * It computes all matches for keypoints in range [start, end[.
+ * It computes the matches of the keypoints handed out by _queue_ until
+ * there are none left, adapting the size of its chunks to the time they take.
  *
  * @param   detector    The detector we want to compute a match.
- * @param   start       The start index.
- * @param   end         The end index.
+ * @param   queue       The queue shared by the threads.
+ * @param   matches     The matches found by the thread.
+ * @param   busy        The time spent computing matches, in seconds.
  */
-void defals::runMatches(copyMoveDetector& detector, int start, int end) {
+void defals::runMatches(copyMoveDetector& detector, WorkQueue& queue, vector<Match>& matches, double& busy) {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _runMatches_";
 
-    BOOST_LOG_TRIVIAL(debug) << "Starting computation of matches [" << start << ", " << start + end << "[";
-    for (int i = start; i < start + end; i++) {
-        detector.computeMatch(i);
+    busy = 0;
+    int first, last;
+    int count = queue.granularity();
+    while (queue.take(count, first, last)) {
+        auto start = chrono::steady_clock::now();
+
+        for (int i = first; i < last; i++)
+            detector.computeMatch(i, matches);
+
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        busy += elapsed.count();
+        count = queue.chunkSize(last - first, elapsed.count());
     }
 
     BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _runMatches_";
 }
 
 /**
- * @copydoc defals::runMatches(copyMoveDetector&,int,int)
+ * @copydoc defals::runMatches(copyMoveDetector&,WorkQueue&,vector<Match>&,double&)
+ * @param   noThread    The number of the thread.
  */
-void defals::runBetterMatches(copyMoveDetector &detector, int start, int end) {
+void defals::runBetterMatches(copyMoveDetector &detector, WorkQueue& queue, int noThread,
+                              vector<Match>& matches, double& busy) {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _runBetterMatches_";
 
-    BOOST_LOG_TRIVIAL(debug) << "Starting computation of matches [" << start << ", " << start + end << "[";
-    for (int i = start; i < start + end; i++) {
-        detector.computeBetterMatch(i);
+    const int batch = detector._options.g2NN_batch;
+    const bool exactAngle = detector._options.g2NN_window == MatchingWindow::ANGLE && !detector._options.g2NN_ann;
+    const bool symmetric = detector.symmetricMatching();
+    const bool blocked = exactAngle && !symmetric && batch > 0;
+    vector<G2NNCollector> band, head;
+
+    busy = 0;
+    InterestPoints::resetAvoidedDistances();
+    int first, last;
+    int count = queue.granularity();
+    while (queue.take(count, first, last)) {
+        auto start = chrono::steady_clock::now();
+
+        if (exactAngle)
+            detector.slideWindow(noThread, first, last);
+
+        if (symmetric) {
+            detector.computeSymmetricChunk(first, last, band, head);
+        }
+        else if (blocked) {
+            for (int i = first; i < last; i += batch)
+                detector.computeBetterMatchBlock(i, min(i + batch, last), matches);
+        }
+        else {
+            for (int i = first; i < last; i++)
+                detector.computeBetterMatch(i, matches);
+        }
+
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        busy += elapsed.count();
+        count = queue.chunkSize(last - first, elapsed.count());
     }
+    if (exactAngle)
+        detector.slideWindow(noThread, detector._interestPoints.size(), detector._interestPoints.size());
+    detector._avoidedDistances += InterestPoints::avoidedDistances();
+    detector._blockAvoidedDistances += InterestPoints::blockAvoidedDistances();
 
     BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _runBetterMatches_";
 }
 
-string infoKeypoint(const InterestPoint& pt) {
+/**
+ * Moves the window of spilled descriptors kept in memory when a thread starts
+ * working on the keypoints in [_first_, _last_[: the descriptors they need are
+ * prefetched, and those no thread needs anymore are released.
+ *
+ * Threads take their chunks in increasing order, so the descriptors before the
+ * window of the first keypoint still being matched by any thread can go.
+ * Does nothing unless the descriptors are spilled.
+ *
+ * @param noThread  The number of the thread.
+ * @param first     The first keypoint of the thread's chunk, the number of keypoints when it's done.
+ * @param last      The keypoint following the last keypoint of the chunk.
+ */
+void copyMoveDetector::slideWindow(int noThread, int first, int last) {
+    if (!_interestPoints.spilled())
+        return;
+
+    _inFlight[noThread] = first;
+    _interestPoints.pageWindow(first, last);
+
+    int lowest = first;
+    for (const auto& inFlight : _inFlight)
+        lowest = min(lowest, inFlight.load());
+    _interestPoints.releaseBefore(lowest);
+}
+
+string infoKeypoint(const InterestPoints& points, int i) {
     string result;
-    result += "\tPosition = (" + to_string(pt.pt.x) + ", " + to_string(pt.pt.y) + ")\n";
-    result += "\tAngle = " + to_string(pt.angle) + "\n";
-    result += "\tIndex in angles : " + to_string(pt.getAngleIdx()) + "\n";
-    result += "\tIndex in norms: " + to_string(pt.getNormIdx()) + "\n";
+    result += "\tPosition = (" + to_string(points.pt(i).x) + ", " + to_string(points.pt(i).y) + ")\n";
+    result += "\tAngle = " + to_string(points.angle(i)) + "\n";
+    result += "\tIndex in angles : " + to_string(i) + "\n";
+    result += "\tIndex in norms: " + to_string(points.normIdx(i)) + "\n";
 
     return result;
 }
 
-void copyMoveDetector::computeBetterMatch(int i) {
+void copyMoveDetector::computeBetterMatch(int i, vector<Match>& matches) const {
     BOOST_LOG_TRIVIAL(trace) << "--> Entering _computeBetterMatch_";
 
     string logString;
 
-    InterestPoint pi = _interestPoints[i];
     logString += "Looking for matches for InterestPoint:\n";
-    logString += infoKeypoint(pi);
-
-    pair<int, int>&& rangeAngle = _interestPoints.getRangeAngle(pi);
-    int minIdxAngle = rangeAngle.first;
-    int maxIdxAngle = rangeAngle.second;
-
-    logString += "Angle window size: " + to_string(maxIdxAngle - minIdxAngle) + " points\n";
-
-    map<double, InterestPoint>&& similarityAngles = _interestPoints.similarityAngle(pi, minIdxAngle, maxIdxAngle);
-
-    vector<InterestPoint> matches;
-    if (!similarityAngles.empty()) {
-        map<double, InterestPoint>::iterator it1, it2;
-        for (it1 = similarityAngles.begin(),
-                     it2 = next(it1);
-             it1 != similarityAngles.end() && it2 != similarityAngles.end();
-             it1++, it2++) {
-            double distance1 = it1->first;
-            double distance2 = it2->first;
-            if (distance1 / distance2 < 0.5 && it1->second.getAngleIdx() != pi.getAngleIdx()) {
-                InterestPoint &pj = it1->second;
-                int j = pj.getAngleIdx();
-
-                if (find(_allMatches[j].begin(), _allMatches[j].end(), _interestPoints[i]) == _allMatches[j].end())
-                    matches.push_back(pj);
-            } else
-                break;
-        }
+    logString += infoKeypoint(_interestPoints, i);
 
-        logString += "InterestPoint has been matched with " + to_string(matches.size()) + " points\n";
+    /*
+     * In the norm window, candidates are sorted by the cached norms of their
+     * descriptors: the window is found by binary search and the norm threshold
+     * is checked without touching the descriptors.
+     */
+    G2NNCollector candidates;
+    long long avoided = InterestPoints::avoidedDistances();
+    if (_options.g2NN_ann) {
+        int computed = _interestPoints.similarityIndex(i, candidates, _options.g2NN_window, _options.g2NN_annChecks);
+        logString += "Approximate neighbours in window: " + to_string(computed) + " points\n";
+    }
+    else if (_options.g2NN_window == MatchingWindow::NORM) {
+        pair<int, int>&& rangeNorm = _interestPoints.getRangeNorm(i);
+        logString += "Norm window size: " + to_string(rangeNorm.second - rangeNorm.first) + " points\n";
 
-        _allMatches[i] = matches;
+        _interestPoints.similarityNorm(i, candidates, rangeNorm.first, rangeNorm.second);
+    }
+    else if (_options.g2NN_window == MatchingWindow::GRID) {
+        int computed = _interestPoints.similarityGrid(i, candidates);
+        logString += "Grid window size: " + to_string(computed) + " points\n";
+    }
+    else {
+        /*
+         * A window wrapping around 0° is made of two ranges of the angle order.
+         */
+        AngleWindow window = _interestPoints.getRangeAngle(i);
+        logString += "Angle window size: " + to_string(window.size()) + " points\n";
+
+        for (int r = 0; r < window.nbRanges; r++)
+            _interestPoints.similarityAngle(i, candidates, window.ranges[r].first, window.ranges[r].second);
     }
+    logString += "Full distances avoided: " + to_string(InterestPoints::avoidedDistances() - avoided) + "\n";
+
+    addMatches(i, candidates, matches, logString);
 
-    if (!matches.empty())
+    if (candidates.nbMatches() > 0)
         BOOST_LOG_TRIVIAL(trace) << logString;
     BOOST_LOG_TRIVIAL(trace) << "<-- Leaving _computeBetterMatch_";
 }
 
 /**
- * This function splits the keypoints indexes in descriptorEquals parts
- * for each thread. Then it creates a thread and makes it process
- * its own slice of keypoints.
+ * Same as copyMoveDetector::computeBetterMatch(int) for the keypoints in [_first_, _last_[,
+ * whose angle windows are compared with a blocked matrix product.
+ *
+ * @param first     The first keypoint of the block.
+ * @param last      The keypoint following the last keypoint of the block.
+ * @param matches   The matches found by the calling thread.
+ */
+void copyMoveDetector::computeBetterMatchBlock(int first, int last, vector<Match>& matches) const {
+    BOOST_LOG_TRIVIAL(trace) << "--> Entering _computeBetterMatchBlock_";
+
+    vector<G2NNCollector> candidates(last - first);
+    _interestPoints.similarityAngleBlock(first, last, candidates);
+
+    for (int i = first; i < last; i++) {
+        string logString = "Looking for matches for InterestPoint:\n";
+        logString += infoKeypoint(_interestPoints, i);
+
+        addMatches(i, candidates[i - first], matches, logString);
+
+        if (candidates[i - first].nbMatches() > 0)
+            BOOST_LOG_TRIVIAL(trace) << logString;
+    }
+
+    BOOST_LOG_TRIVIAL(trace) << "<-- Leaving _computeBetterMatchBlock_";
+}
+
+/**
+ * Compares the keypoints in [_first_, _last_[ with their angle windows, computing the
+ * distance of each pair once, and merges the candidates found into _collectors.
+ *
+ * @param first     The first keypoint of the chunk.
+ * @param last      The keypoint following the last keypoint of the chunk.
+ * @param band      Storage for the collectors of InterestPoints::similaritySymmetric.
+ * @param head      Storage for the collectors of InterestPoints::similaritySymmetric.
+ */
+void copyMoveDetector::computeSymmetricChunk(int first, int last, vector<G2NNCollector>& band,
+                                             vector<G2NNCollector>& head) {
+    _interestPoints.similaritySymmetric(first, last, band, head);
+
+    mergeCollectors(first, band);
+    mergeCollectors(0, head);
+}
+
+/**
+ * Merges collectors filled by a thread into _collectors. Each collector is
+ * locked while merging, through the stripe it belongs to.
+ *
+ * @param first     The index of the keypoint of _local[0]_.
+ * @param local     The collectors to merge.
+ */
+void copyMoveDetector::mergeCollectors(int first, const vector<G2NNCollector>& local) {
+    for (size_t k = 0; k < local.size(); k++) {
+        if (local[k].size() == 0)
+            continue;
+
+        int i = first + k;
+        lock_guard<mutex> lock(_stripes[i % NB_STRIPES]);
+        _collectors[i].merge(local[k]);
+    }
+}
+
+/**
+ * Records the candidates of the i-th keypoint that passed the ratio test.
+ * A match found from both of its keypoints is recorded twice here: duplicates
+ * are removed once all threads are done, by copyMoveDetector::mergeMatches.
+ *
+ * @param i             The index of the keypoint.
+ * @param candidates    The candidates of the keypoint.
+ * @param matches       The matches found by the calling thread.
+ * @param logString     The trace message for the keypoint.
+ */
+void copyMoveDetector::addMatches(int i, const G2NNCollector& candidates, vector<Match>& matches, string& logString) {
+    /*
+     * The collector gives the candidates by ascending distance: the first
+     * nbMatches() ones passed the ratio test.
+     */
+    for (int k = 0; k < candidates.nbMatches(); k++)
+        matches.emplace_back(i, candidates.index(k), candidates.distance(k));
+
+    logString += "InterestPoint has been matched with " + to_string(candidates.nbMatches()) + " points\n";
+}
+
+/**
+ * Gathers the matches found by every thread in _allMatches, each pair of keypoints once.
+ *
+ * Each thread's matches are canonicalized and sorted by their own thread, then the
+ * sorted lists are merged and the duplicates removed. The result only depends on the
+ * set of matches found, not on the number of threads nor on which thread found what.
+ *
+ * @param threadMatches     The matches found by each thread. They are consumed.
+ */
+void copyMoveDetector::mergeMatches(vector<vector<Match>>& threadMatches) {
+    BOOST_LOG_TRIVIAL(debug) << "--> Entering _mergeMatches_";
+
+    vector<thread> threads;
+    for (auto& matches : threadMatches) {
+        threads.emplace_back([&matches]() {
+            for (auto& match : matches)
+                match.canonicalize();
+            sort(matches.begin(), matches.end());
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    /*
+     * Sorted lists are merged two by two, so that every match is moved
+     * about log2(jobs) times.
+     */
+    for (size_t step = 1; step < threadMatches.size(); step *= 2) {
+        for (size_t k = 0; k + step < threadMatches.size(); k += 2 * step) {
+            vector<Match> merged;
+            merged.reserve(threadMatches[k].size() + threadMatches[k + step].size());
+            merge(threadMatches[k].begin(), threadMatches[k].end(),
+                  threadMatches[k + step].begin(), threadMatches[k + step].end(),
+                  back_inserter(merged));
+            threadMatches[k] = move(merged);
+            vector<Match>().swap(threadMatches[k + step]);
+        }
+    }
+
+    _allMatches.clear();
+    if (!threadMatches.empty())
+        _allMatches = move(threadMatches[0]);
+
+    size_t found = _allMatches.size();
+    _allMatches.erase(unique(_allMatches.begin(), _allMatches.end(),
+                             [](const Match& a, const Match& b) { return a.samePair(b); }),
+                      _allMatches.end());
+
+    BOOST_LOG_TRIVIAL(debug) << "Kept " << _allMatches.size() << " matches out of " << found << " found";
+    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _mergeMatches_";
+}
+
+/**
+ * Logs the time each thread spent computing matches, and how far the
+ * slowest thread is from the average.
+ *
+ * @param busy  The busy time of each thread, in seconds.
+ */
+static void logBusyTimes(const vector<double>& busy) {
+    double total = 0, slowest = 0;
+    for (size_t noThread = 0; noThread < busy.size(); noThread++) {
+        BOOST_LOG_TRIVIAL(debug) << "Thread " << noThread << " was busy for " << busy[noThread] << " s";
+        total += busy[noThread];
+        slowest = max(slowest, busy[noThread]);
+    }
+
+    if (total > 0)
+        BOOST_LOG_TRIVIAL(debug) << "Load imbalance (slowest / average): " << slowest * busy.size() / total;
+}
+
+/**
+ * This function creates the threads computing the matches. They share
+ * a WorkQueue handing out the keypoints chunk by chunk, so that every
+ * keypoint is processed and threads stay busy until the end.
  * It waits for all threads to finish running before exiting.
  */
 void copyMoveDetector::computeMatches() {
     int nbMatches = _interestPoints.size();
-    _allMatches = vector<vector<InterestPoint>>(nbMatches);
 
     const int nbThreads = _options.jobs;
-    int matchesByThread = nbMatches / nbThreads;
+    WorkQueue queue(0, nbMatches, nbThreads);
+    vector<vector<Match>> threadMatches(nbThreads);
+    vector<double> busy(nbThreads);
     vector<thread> threads;
     for (int noThread = 0; noThread < nbThreads; noThread++) {
-        int start = noThread * matchesByThread;
-        thread t(runMatches, ref(*this), start, matchesByThread);
+        thread t(runMatches, ref(*this), ref(queue), ref(threadMatches[noThread]), ref(busy[noThread]));
         threads.push_back(move(t));
     }
 
     for (auto& t : threads)
         t.join();
 
+    logBusyTimes(busy);
+    mergeMatches(threadMatches);
 }
 
+/**
+ * @copydoc copyMoveDetector::computeMatches()
+ *
+ * When keypoints are matched by blocks, chunks are made of whole blocks.
+ */
 void copyMoveDetector::computeBetterMatches() {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeBetterMatches_";
 
+    BOOST_LOG_TRIVIAL(debug) << "Looking for " << _interestPoints.size() << " matches";
+    BOOST_LOG_TRIVIAL(debug) << "Descriptor distances computed with " << l2sqKernel() << " kernel";
+    if (_options.g2NN_batch > 0 && (_options.g2NN_window != MatchingWindow::ANGLE || _options.g2NN_ann))
+        BOOST_LOG_TRIVIAL(warning) << "Blocked matching is only available with the exact angle window";
+    if (_options.g2NN_batch > 0 && _interestPoints.storage() != DescriptorStorage::FLOAT)
+        BOOST_LOG_TRIVIAL(warning) << "Blocked matching reads the float descriptors, compact descriptors are ignored";
+    if (_options.g2NN_symmetric && !symmetricMatching())
+        BOOST_LOG_TRIVIAL(warning) << "Symmetric matching is only available with the exact, uncapped angle window";
+    if (_interestPoints.spilled() && (_options.g2NN_window != MatchingWindow::ANGLE || _options.g2NN_ann))
+        BOOST_LOG_TRIVIAL(warning) << "Spilled descriptors are only read through a sliding window with the exact "
+                                      "angle window, other windows may read the whole file";
+
+    if (_options.workers > 0 && !shardable())
+        BOOST_LOG_TRIVIAL(warning) << "Worker processes are only available with the exact angle and grid windows";
+
+    if (!_workers.empty())
+        computeShardedMatches();
+    else
+        launchBetterMatches(0, _interestPoints.size());
+
+    if (_options.g2NN_ann && _options.g2NN_annRecall)
+        reportRecall();
+
+    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeBetterMatches_";
+}
+
+/**
+ * @return  True if matching computes each distance once. Windows have to be symmetric for that:
+ *          it's the case of the exact angle window, unless its size is capped.
+ */
+bool copyMoveDetector::symmetricMatching() const {
+    return _options.g2NN_symmetric && _options.g2NN_window == MatchingWindow::ANGLE &&
+           !_options.g2NN_ann && _options.g2NN_cap == 0;
+}
+
+/**
+ * Creates the threads computing the matches of the keypoints in [_first_, _last_[
+ * and waits for them, then gathers their matches in _allMatches.
+ *
+ * In symmetric matching, the threads only gather the candidates of each keypoint:
+ * the ratio test is run once all of them are done.
+ *
+ * @param first     The first keypoint to match.
+ * @param last      The keypoint following the last keypoint to match.
+ */
+void copyMoveDetector::launchBetterMatches(int first, int last) {
     int nbMatches = _interestPoints.size();
-    _allMatches = vector<vector<InterestPoint>>(nbMatches);
-    BOOST_LOG_TRIVIAL(debug) << "Looking for " << nbMatches << " matches";
+
+    const bool symmetric = symmetricMatching();
+    if (symmetric)
+        _collectors.assign(nbMatches, G2NNCollector());
+
+    /*
+     * Threads that haven't taken a chunk yet don't hold any descriptor.
+     */
+    _inFlight = vector<atomic<int>>(_options.jobs);
+    for (auto& inFlight : _inFlight)
+        inFlight = nbMatches;
+
+    _avoidedDistances = 0;
+    _blockAvoidedDistances = 0;
 
     const int nbThreads = _options.jobs;
-    int matchesByThreads = nbMatches / nbThreads;
-    BOOST_LOG_TRIVIAL(debug) << "Launching search with " << nbThreads << " threads (" << matchesByThreads << " points by thread)";
+    WorkQueue queue(first, last, nbThreads, max(_options.g2NN_batch, 1));
+    vector<vector<Match>> threadMatches(nbThreads);
+    vector<double> busy(nbThreads);
+
+    BOOST_LOG_TRIVIAL(debug) << "Launching search with " << nbThreads << " threads";
     vector<thread> threads;
     for (int noThread = 0; noThread < nbThreads; noThread++) {
-        int start = noThread * matchesByThreads;
-        BOOST_LOG_TRIVIAL(debug) << "Launching thread " << noThread << " on interval [" << start << ", " << start + matchesByThreads << "]";
-        thread t(runBetterMatches, ref(*this), start, matchesByThreads);
+        thread t(runBetterMatches, ref(*this), ref(queue), noThread, ref(threadMatches[noThread]), ref(busy[noThread]));
         threads.push_back(move(t));
     }
 
@@ -500,7 +1038,216 @@ void copyMoveDetector::computeBetterMatches() {
     for (auto& t : threads)
         t.join();
 
-    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeBetterMatches_";
+    logBusyTimes(busy);
+
+    if (_interestPoints.projectionSize() > 0 || _interestPoints.storage() != DescriptorStorage::FLOAT) {
+        BOOST_LOG_TRIVIAL(info) << "Prefilters avoided " << _avoidedDistances << " full distances, "
+                                << (double) _avoidedDistances / max(last - first, 1) << " per keypoint";
+    }
+    if (_blockAvoidedDistances > 0) {
+        BOOST_LOG_TRIVIAL(info) << "Blocked matrix products avoided " << _blockAvoidedDistances << " exact distances, "
+                                << (double) _blockAvoidedDistances / max(last - first, 1) << " per keypoint";
+    }
+
+    if (symmetric) {
+        for (int i = first; i < last; i++) {
+            string logString;
+            addMatches(i, _collectors[i], threadMatches[0], logString);
+        }
+        vector<G2NNCollector>().swap(_collectors);
+    }
+
+    mergeMatches(threadMatches);
+}
+
+/**
+ * @return  True if matching can be split between worker processes: windows have to be
+ *          exact angle or grid windows, whose halo is known from the angle order.
+ */
+bool copyMoveDetector::shardable() const {
+    return (_options.g2NN_window == MatchingWindow::ANGLE || _options.g2NN_window == MatchingWindow::GRID) &&
+           !_options.g2NN_ann;
+}
+
+/**
+ * Starts the _workers_ worker processes of sharded matching. They're forked before the
+ * image is read, so they only hold the options: everything they match is rebuilt from
+ * the shard they wait for, see copyMoveDetector::runWorker.
+ */
+void copyMoveDetector::startWorkers() {
+    for (int w = 0; w < _options.workers; w++) {
+        int toWorker[2], fromWorker[2];
+        if (pipe(toWorker) != 0 || pipe(fromWorker) != 0) {
+            cerr << "Couldn't create pipes for worker " << w << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "Couldn't start worker " << w << ": " << strerror(errno) << endl;
+            exit(1);
+        }
+        if (pid == 0) {
+            /*
+             * The pipes of the previous workers must only be open in the coordinator,
+             * so that they're closed when it exits.
+             */
+            for (const auto& worker : _workers) {
+                close(worker.shardPipe);
+                close(worker.matchesPipe);
+            }
+            close(toWorker[1]);
+            close(fromWorker[0]);
+            runWorker(toWorker[0], fromWorker[1]);
+            _exit(0);
+        }
+        close(toWorker[0]);
+        close(fromWorker[1]);
+
+        _workers.push_back({ pid, toWorker[1], fromWorker[0] });
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Started " << _workers.size() << " workers";
+}
+
+/**
+ * Splits the keypoints in as many ranges of the angle order as there are workers, and
+ * sends each worker its shard: the keypoints it owns and the halo of keypoints their
+ * windows reach. Then gathers their matches in _allMatches.
+ *
+ * Workers see the same windows as this process would, so the matches don't depend on
+ * the number of workers.
+ */
+void copyMoveDetector::computeShardedMatches() {
+    BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeShardedMatches_";
+
+    const int n = _interestPoints.size();
+    const int workers = _workers.size();
+
+    for (int w = 0; w < workers; w++) {
+        int first = (long) n * w / workers;
+        int last = (long) n * (w + 1) / workers;
+
+        Shard shard = makeShard(_interestPoints, first, last, _options.g2NN_window);
+        BOOST_LOG_TRIVIAL(debug) << "Worker " << w << " owns keypoints [" << first << ", " << last << "[ with a halo of "
+                                 << shard.indices.size() - (last - first) << " keypoints";
+
+        writeShard(_workers[w].shardPipe, _interestPoints, shard);
+        close(_workers[w].shardPipe);
+    }
+
+    vector<vector<Match>> shardMatches(workers);
+    for (int w = 0; w < workers; w++) {
+        bool received = readMatches(_workers[w].matchesPipe, shardMatches[w]);
+        close(_workers[w].matchesPipe);
+
+        int status;
+        waitpid(_workers[w].pid, &status, 0);
+        if (!received || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            cerr << "Worker " << w << " failed" << endl;
+            exit(1);
+        }
+    }
+    _workers.clear();
+
+    mergeMatches(shardMatches);
+
+    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeShardedMatches_";
+}
+
+/**
+ * Body of a worker process: reads a shard, matches the keypoints it owns with
+ * _jobs_ threads, and writes the matches back with their indices in the whole
+ * angle order. The process exits if the coordinator goes away before sending it.
+ *
+ * @param input     The pipe the shard is read from.
+ * @param output    The pipe the matches are written to.
+ */
+void copyMoveDetector::runWorker(int input, int output) {
+    Shard shard;
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    if (!readShard(input, shard, keypoints, descriptors))
+        _exit(1);
+    close(input);
+
+    if (shard.ownedFirst == shard.ownedLast) {
+        writeMatches(output, _allMatches);
+        close(output);
+        return;
+    }
+
+    /*
+     * The shard is given in the angle order, so the keypoints keep the same
+     * relative order here and ties are broken the same way as in the coordinator.
+     * The thresholds may have been tuned on all the keypoints.
+     */
+    _options.g2NN_angleThreshold = shard.angleThreshold;
+    _interestPoints = InterestPoints(keypoints, descriptors,
+                                     shard.angleThreshold, _options.g2NN_normThreshold,
+                                     _options.jobs);
+    _interestPoints.setMinSeparation(_options.g2NN_separation);
+    _interestPoints.setCandidateCap(_options.g2NN_cap);
+    _interestPoints.setNormWindow(shard.normWindow);
+    _interestPoints.buildCompactDescriptors(_options.g2NN_storage);
+    if (!_options.g2NN_pcaFile.empty())
+        _interestPoints.loadProjection(_options.g2NN_pcaFile);
+    else if (_options.g2NN_pca > 0)
+        _interestPoints.learnProjection(_options.g2NN_pca);
+    if (_options.g2NN_window == MatchingWindow::GRID)
+        _interestPoints.buildGrid(_options.g2NN_octaveThreshold);
+
+    /*
+     * In symmetric matching, the pairs owned by the halo's keypoints would never be computed.
+     */
+    _options.g2NN_symmetric = false;
+    launchBetterMatches(shard.ownedFirst, shard.ownedLast);
+
+    for (auto& match : _allMatches) {
+        match.i = shard.indices[match.i];
+        match.j = shard.indices[match.j];
+    }
+    writeMatches(output, _allMatches);
+    close(output);
+}
+
+/**
+ * Computes the matches again with exact windowed matching and reports the
+ * recall of the approximate matches, that is the share of the exact matches
+ * they found. The approximate matches are kept.
+ *
+ * The index scores at most G2NNCollector::CAPACITY candidates per keypoint, so a
+ * keypoint whose exact match isn't among its 16 approximate neighbours is missed
+ * however many leaves are checked.
+ */
+void copyMoveDetector::reportRecall() {
+    BOOST_LOG_TRIVIAL(debug) << "--> Entering _reportRecall_";
+
+    vector<Match> approximate = move(_allMatches);
+
+    _options.g2NN_ann = false;
+    auto start = chrono::steady_clock::now();
+    launchBetterMatches(0, _interestPoints.size());
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    _options.g2NN_ann = true;
+
+    vector<Match> exact = move(_allMatches);
+    _allMatches = move(approximate);
+
+    /*
+     * Both lists are sorted by pair of keypoints and hold each pair once.
+     */
+    vector<Match> common;
+    set_intersection(_allMatches.begin(), _allMatches.end(), exact.begin(), exact.end(), back_inserter(common),
+                     [](const Match& a, const Match& b) { return tie(a.i, a.j) < tie(b.i, b.j); });
+
+    double recall = exact.empty() ? 1 : (double) common.size() / exact.size();
+    BOOST_LOG_TRIVIAL(info) << "Approximate matching found " << common.size() << " of the " << exact.size()
+                            << " exact matches (recall: " << recall << "), and "
+                            << _allMatches.size() - common.size() << " other matches";
+    BOOST_LOG_TRIVIAL(info) << "Exact matching took " << elapsed.count() << " s";
+
+    BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _reportRecall_";
 }
 
 /**
@@ -524,19 +1271,16 @@ inline bool lex(const T& p1, const T& p2) {
 void copyMoveDetector::computeLines() {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeLines_";
 
-    for (size_t i = 0; i < _allMatches.size(); i++) {
-        vector<InterestPoint> matches = _allMatches[i];
-        InterestPoint origin = _interestPoints.get(i);
-        for (const auto& pt : matches) {
-            Line droite(origin, pt);
-            BOOST_LOG_TRIVIAL(trace) << "Created line [(" <<
-                                     origin.pt.x << ", " << origin.pt.y << "), (" <<
-                                     pt.pt.x << ", " << pt.pt.y << ") of length " << droite.length();
-            if (lex(pt.pt, origin.pt))
-                droite.invert();
-            if (droite.length() >= _options.length)
-                _lines.push_back(droite);
-        }
+    for (const auto& match : _allMatches) {
+        Point2f origin = _interestPoints.pt(match.i);
+        Point2f pt = _interestPoints.pt(match.j);
+        Segment droite = lex(pt, origin) ? Segment::between(pt, origin, match.j, match.i)
+                                         : Segment::between(origin, pt, match.i, match.j);
+        BOOST_LOG_TRIVIAL(trace) << "Created line [(" <<
+                                 origin.x << ", " << origin.y << "), (" <<
+                                 pt.x << ", " << pt.y << ") of length " << droite.length;
+        if (droite.length >= _options.length)
+            _lines.push_back(droite);
     }
 
     BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeLines_";
@@ -550,24 +1294,27 @@ void copyMoveDetector::computeLines() {
 void copyMoveDetector::computeClusters() {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeClusters_";
 
-    vector<ClusteredLine> lines(_lines.begin(), _lines.end());
+    // Parameters for GRIP : minPts = 4 ; eps = 1000
+    DBSCAN scanner(_options.dbscan_minPts, _options.dbscan_epsilon, _lines,
+                   _image.rows, _image.cols,
+                   _options.dbscan_wx, _options.dbscan_wy, _options.dbscan_wtheta);
+    //DBSCAN scanner(4, 9000, lines, _image.rows, _image.cols);
+
+    /*
+     * The neighbourhoods are computed once: each retry with a lower minPts
+     * only extracts the clusters again from them.
+     */
+    scanner.computeNeighbourhoods(_options.jobs);
 
     bool ok = false;
     while (!ok && _options.dbscan_minPts >= 2) {
-        // Parameters for GRIP : minPts = 4 ; eps = 1000
-        DBSCAN scanner(_options.dbscan_minPts, _options.dbscan_epsilon, lines,
-                       _image.rows, _image.cols,
-                       _options.dbscan_wx, _options.dbscan_wy, _options.dbscan_wtheta);
-        //DBSCAN scanner(4, 9000, lines, _image.rows, _image.cols);
-
-        BOOST_LOG_TRIVIAL(debug) << "Starting scanner with parameters minPts = " << _options.dbscan_minPts <<
+        BOOST_LOG_TRIVIAL(debug) << "Extracting clusters with parameters minPts = " << _options.dbscan_minPts <<
                                     " and epsilon = " << _options.dbscan_epsilon;
 
-        vector<ClusteredLine> clusteredLines = scanner.run();
+        vector<int> labels = scanner.extract(_options.dbscan_minPts, _options.dbscan_epsilon, _options.jobs);
 
         int nbClusters = 0;
-        for (const auto &line : clusteredLines) {
-            int id = line.getId();
+        for (const auto &id : labels) {
             if (id > 0) {
                 if (id > nbClusters)
                     nbClusters = id;
@@ -575,8 +1322,9 @@ void copyMoveDetector::computeClusters() {
         }
 
         vector<Cluster> clusters(nbClusters);
-        for (const auto &line : clusteredLines) {
-            int id = line.getId();
+        _outliers.clear();
+        for (size_t line = 0; line < labels.size(); line++) {
+            int id = labels[line];
             if (id > 0)  // Hey don't forget indices start at 0
                 clusters[id - 1].push_back(line);
             else
@@ -610,32 +1358,26 @@ void copyMoveDetector::computeHull() {
     BOOST_LOG_TRIVIAL(debug) << "--> Entering _computeHull_";
 
     for (const auto& cluster : _clusters) {
-        vector<tuple<Point, InterestPoint, Line>> starts, ends;
+        vector<Point> actualStarts, actualEnds;
         for (const auto& line : cluster) {
-            starts.emplace_back(line.getPoint1().pt, line.getPoint1(), line);
-            ends.emplace_back(line.getPoint2().pt, line.getPoint2(), line);
+            actualStarts.push_back(_lines[line].start());
+            actualEnds.push_back(_lines[line].end());
         }
 
-        vector<Point> actualStarts, actualEnds;
-        for (const auto& p : starts)
-            actualStarts.push_back(get<0>(p));
-        for (const auto& p : ends)
-            actualEnds.push_back(get<0>(p));
-
         vector<int> hullStarts, hullEnds;
         convexHull(actualStarts, hullStarts);
         convexHull(actualEnds, hullEnds);
 
-        vector<pair<InterestPoint, Line>> ptsStarts, ptsEnds;
+        vector<pair<Point2f, Point2f>> ptsStarts, ptsEnds;
 
         for (const auto& i : hullStarts)
-            ptsStarts.emplace_back(get<1>(starts[i]), get<2>(starts[i]));
+            ptsStarts.emplace_back(_lines[cluster[i]].start(), _lines[cluster[i]].end());
         _hulls.emplace_back(ptsStarts);
 
         BOOST_LOG_TRIVIAL(debug) << "Initial hull contains " << ptsStarts.size() << " points";
 
         for (const auto& i : hullEnds)
-            ptsEnds.emplace_back(get<1>(ends[i]), get<2>(ends[i]));
+            ptsEnds.emplace_back(_lines[cluster[i]].end(), _lines[cluster[i]].start());
         _hulls.emplace_back(ptsEnds);
 
         BOOST_LOG_TRIVIAL(debug) << "Matching hull contains " << ptsEnds.size() << " points";
@@ -654,7 +1396,7 @@ void copyMoveDetector::computeMask(int kernelSize) {
     for (const auto& hull : _hulls) {
         vector<Point> pts;
         for (const auto& pt : hull) {
-            pts.push_back(pt.first.pt);
+            pts.push_back(pt.first);
         }
         hulls.push_back(pts);
     }
@@ -666,16 +1408,6 @@ void copyMoveDetector::computeMask(int kernelSize) {
     BOOST_LOG_TRIVIAL(debug) << "<-- Leaving _computeMask_";
 }
 
-inline const InterestPoint& getMatch(const InterestPoint& pt, const Line& line) {
-    if (pt == line.getPoint1())
-        return line.getPoint2();
-    else if (pt == line.getPoint2())
-        return line.getPoint1();
-
-    BOOST_LOG_TRIVIAL(error) << "Point not in line";
-    exit(1);
-}
-
 inline Vec3f RGBtoYCbCr(const Vec3b& BGR) {
     uchar B = BGR[0];
     uchar G = BGR[1];
@@ -809,15 +1541,15 @@ vector<pair<Point, Point>> copyMoveDetector::borderOfHull(int i) const {
     auto it2 = next(it1);
     for (; it1 != _hulls[i].end() && it2 != _hulls[i].end();
            it1++, it2++) {
-        const InterestPoint& one = it1->first;
-        const InterestPoint& matchOne = getMatch(one, it1->second);
-        const InterestPoint& two = it2->first;
-        const InterestPoint& matchTwo = getMatch(two, it2->second);
+        const Point2f& one = it1->first;
+        const Point2f& matchOne = it1->second;
+        const Point2f& two = it2->first;
+        const Point2f& matchTwo = it2->second;
 
-        pts.emplace_back(one.pt, matchOne.pt);
+        pts.emplace_back(one, matchOne);
 
-        LineIterator intermediaires(_image, one.pt, two.pt, 8, true);
-        LineIterator matches(_image, matchOne.pt, matchTwo.pt, 8, true);
+        LineIterator intermediaires(_image, one, two, 8, true);
+        LineIterator matches(_image, matchOne, matchTwo, 8, true);
 
         size_t smallest = intermediaires.count < matches.count ? intermediaires.count : matches.count;
 
@@ -825,7 +1557,7 @@ vector<pair<Point, Point>> copyMoveDetector::borderOfHull(int i) const {
             pts.emplace_back(intermediaires.pos(), matches.pos());
         }
 
-        pts.emplace_back(two.pt, matchTwo.pt);
+        pts.emplace_back(two, matchTwo);
     }
     const Point& one = pts[pts.size() - 1].first;
     const Point& matchOne = pts[pts.size() - 1].second;
@@ -851,12 +1583,12 @@ double copyMoveDetector::computePSNR(int i) const {
 
     vector<Point> firstHull;
     for (const auto& pt : _hulls[i])
-        firstHull.emplace_back(pt.first.pt);
+        firstHull.emplace_back(pt.first);
     hulls.emplace_back(firstHull);
 
     vector<Point> secondHull;
     for (const auto& pt : _hulls[i + 1])
-        secondHull.emplace_back(pt.first.pt);
+        secondHull.emplace_back(pt.first);
     hulls.emplace_back(secondHull);
 
 
@@ -1201,11 +1933,11 @@ void copyMoveDetector::randomLines() {
     for (int i = 0; i < 3; i++) {
         Line&& line = genInitialLine(maxWidth, maxHeight);
         if (line != origin) {
-            _lines.emplace_back(line);
+            _lines.push_back(Segment::between(line.getPoint1().pt, line.getPoint2().pt));
             for (int j = 0; j < 100; j++) {
                 Line&& parallel = genParallelLine(maxWidth, maxHeight, line);
                 if (parallel != origin)
-                    _lines.emplace_back(parallel);
+                    _lines.push_back(Segment::between(parallel.getPoint1().pt, parallel.getPoint2().pt));
             }
         }
     }
@@ -1213,7 +1945,7 @@ void copyMoveDetector::randomLines() {
     for (int i = 0; i < 50; i++) {
         Line&& line = genInitialLine(maxWidth, maxHeight);
         if (line != origin)
-            _lines.emplace_back(line);
+            _lines.push_back(Segment::between(line.getPoint1().pt, line.getPoint2().pt));
     }
 
 }
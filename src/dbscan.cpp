@@ -1,5 +1,14 @@
 #include "../include/dbscan.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <numeric>
+#include <thread>
+
+#include "../include/WorkQueue.hpp"
+#include "../include/distance.hpp"
+
 using namespace std;
 using namespace defals;
 
@@ -8,129 +17,449 @@ using namespace defals;
  *
  * @param minPts    Minimal number of points required in a eps-neighbourhood.
  * @param eps       Radius of the neighbourhood.
- * @param lines     The lines to cluster.
+ * @param lines     The lines to cluster. They're not copied: they must outlive the scanner.
  */
-DBSCAN::DBSCAN(unsigned int minPts, double eps, std::vector<defals::ClusteredLine>& lines,
+DBSCAN::DBSCAN(unsigned int minPts, double eps, const std::vector<defals::Segment>& lines,
                int height, int width,
-               double wx, double wy, double wtheta) {
+               double wx, double wy, double wtheta) : _lines(lines) {
     _minPoints = minPts;
     _epsilon = eps;
-    _lines = lines;
     _height = height;
     _width = width;
     _wx = wx;
     _wy = wy;
     _wtheta = wtheta;
+    _wl = 1 - _wx - _wy - _wtheta;
+    _sizeRatio = (_height + _width) / 2;
+
+    buildGrid();
+}
+
+/**
+ * Calls _function_ on every line from _jobs_ threads. The lines are handed out by chunks,
+ * as dense areas make some region queries much longer than others.
+ */
+template<class Function>
+static void parallelFor(int n, int jobs, Function function)
+{
+    static const int CHUNK = 64;
+
+    WorkQueue queue(0, n, jobs);
+    auto work = [&queue, &function]() {
+        int first, last;
+        while (queue.take(CHUNK, first, last)) {
+            for (int line = first; line < last; line++)
+                function(line);
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 0; t < max(jobs, 1); t++)
+        threads.emplace_back(work);
+    for (auto& t : threads)
+        t.join();
+}
+
+/**
+ * Finds the root of the set of _x_, halving the path on the way. Parents always have a
+ * lower index than their children, so concurrent halvings can't create a cycle.
+ *
+ * @return  The root of the set, its lowest line.
+ */
+static int findRoot(vector<atomic<int>>& parent, int x)
+{
+    while (true) {
+        int p = parent[x].load();
+        if (p == x)
+            return x;
+
+        int grandParent = parent[p].load();
+        if (grandParent != p)
+            parent[x].compare_exchange_weak(p, grandParent);
+        x = grandParent;
+    }
+}
+
+/**
+ * Merges the sets of _a_ and _b_ by linking the highest root under the lowest one.
+ * A link only succeeds if the root is still a root, otherwise the roots are found again.
+ */
+static void unite(vector<atomic<int>>& parent, int a, int b)
+{
+    while (true) {
+        a = findRoot(parent, a);
+        b = findRoot(parent, b);
+        if (a == b)
+            return;
+        if (a < b)
+            swap(a, b);
+
+        int expected = a;
+        if (parent[a].compare_exchange_strong(expected, b))
+            return;
+    }
 }
 
 /**
- * This is the method that starts the DBSCAN algorithm.
+ * Computes the eps-neighbourhood of every line with _jobs_ threads, and keeps the minPts
+ * nearest neighbours of each line, sorted by distance. The other neighbours are only counted,
+ * so the graph holds at most minPts edges per line.
  *
- * @return  A vector containing the lines with their _idCluster set.
+ * @param jobs  The number of threads.
  */
-vector<ClusteredLine> DBSCAN::run()
+void DBSCAN::computeNeighbourhoods(int jobs)
 {
-    int clusterID = 1;
-    vector<ClusteredLine>::iterator iter;
-    for(iter = _lines.begin(); iter != _lines.end(); ++iter)
-    {
-        if (iter->getId() == UNCLASSIFIED)
-        {
-            if (expandCluster(*iter, clusterID) != FAILURE)
-                clusterID++;
+    const int n = _lines.size();
+    const size_t kept = max(_minPoints, 1u);
+
+    vector<vector<pair<double, int>>> neighbourhoods(n);
+    _neighbourhoodSizes.assign(n, 0);
+    parallelFor(n, jobs, [this, &neighbourhoods, kept](int line) {
+        vector<pair<double, int>> neighbourhood = calculateNeighbourhood(line);
+        _neighbourhoodSizes[line] = neighbourhood.size();
+
+        size_t size = min(kept, neighbourhood.size());
+        partial_sort(neighbourhood.begin(), neighbourhood.begin() + size, neighbourhood.end());
+        neighbourhoods[line].assign(neighbourhood.begin(), neighbourhood.begin() + size);
+    });
+
+    _neighbourStart.assign(n + 1, 0);
+    for (int line = 0; line < n; line++)
+        _neighbourStart[line + 1] = _neighbourStart[line] + neighbourhoods[line].size();
+
+    _neighbours.resize(_neighbourStart[n]);
+    _neighbourDistances.resize(_neighbourStart[n]);
+    for (int line = 0; line < n; line++) {
+        int k = _neighbourStart[line];
+        for (const auto& neighbour : neighbourhoods[line]) {
+            _neighbourDistances[k] = neighbour.first;
+            _neighbours[k] = neighbour.second;
+            k++;
         }
+        vector<pair<double, int>>().swap(neighbourhoods[line]);
     }
-    return _lines;
 }
 
 /**
- * Given a line, creates new cluster from it, adds line to another cluster
- * or classifies it as noise.
+ * Computes the core distance of a line: the radius its neighbourhood needs to hold _minPts_ lines.
+ *
+ * @param line      The index of the line.
+ * @param minPts    The minimal number of points of a neighbourhood.
  *
- * @param line          A line that hasn't been clustered yet.
- * @param clusterID     The ID of the cluster we're expanding.
+ * A _minPts_ above the number of neighbours kept by DBSCAN::computeNeighbourhoods runs
+ * a region query again.
  *
- * @return      SUCCESS if the line has been successfully classified.
- *              FAILRUE if the line has been classified as noise.
+ * @return  The core distance, infinite if fewer than _minPts_ lines are within eps.
  */
-int DBSCAN::expandCluster(ClusteredLine& line, int clusterID) {
-    /*
-     * Compute the eps-neighbourhood of _line_.
-     */
-    vector<int> clusterSeeds = calculateCluster(line);
-
-    /*
-     * If there aren't enough lines in the eps-neighbourhood,
-     * we classify it as noise.
-     */
-    if (clusterSeeds.size() < _minPoints)
-    {
-        line.setId(NOISE);
-        return FAILURE;
+double DBSCAN::coreDistance(int line, unsigned int minPts) const
+{
+    unsigned int kept = _neighbourStart[line + 1] - _neighbourStart[line];
+    if (minPts == 0)
+        return 0;
+    if ((unsigned int) _neighbourhoodSizes[line] < minPts)
+        return numeric_limits<double>::infinity();
+    if (minPts <= kept)
+        return _neighbourDistances[_neighbourStart[line] + minPts - 1];
+
+    vector<pair<double, int>> neighbourhood = calculateNeighbourhood(line);
+    nth_element(neighbourhood.begin(), neighbourhood.begin() + minPts - 1, neighbourhood.end());
+    return neighbourhood[minPts - 1].first;
+}
+
+/**
+ * Extracts the DBSCAN clusters for the given parameters from the neighbourhood graph,
+ * computed beforehand by DBSCAN::computeNeighbourhoods.
+ *
+ * The lines are handed out to _jobs_ threads, in two passes:
+ * - the first one finds the core lines, whose core distance is at most _eps_ ;
+ * - the second one merges each core line with the core lines of its neighbourhood in a
+ *   lock-free union-find, and gives each other line of the neighbourhood to the lowest
+ *   core line reaching it. The neighbourhood is read from the graph when every neighbour
+ *   within _eps_ was kept, and found by a region query otherwise.
+ * Clusters are the sets of core lines, along with the lines given to them. They are numbered
+ * from 1 by their lowest line, thus the labels don't depend on the number of threads.
+ *
+ * The neighbourhoods aren't symmetric, as the distance is scaled by the core line: this
+ * merges core lines reaching each other in either direction, which is what DBSCAN does
+ * when the neighbourhoods are symmetric.
+ *
+ * @param minPts    The minimal number of points in a neighbourhood.
+ * @param eps       The radius of the neighbourhoods. Neighbours farther than the radius of the
+ *                  scanner are unknown, so a larger radius is clamped to it.
+ * @param jobs      The number of threads.
+ *
+ * @return  A vector containing the ID of the cluster of each line, NOISE for the outliers.
+ */
+vector<int> DBSCAN::extract(unsigned int minPts, double eps, int jobs)
+{
+    const int n = _lines.size();
+    const int nobody = numeric_limits<int>::max();
+    eps = min(eps, _epsilon);
+
+    vector<char> core(n);
+    parallelFor(n, jobs, [this, &core, minPts, eps](int line) {
+        core[line] = coreDistance(line, minPts) <= eps;
+    });
+
+    vector<atomic<int>> parent(n);
+    vector<atomic<int>> owner(n);
+    for (int line = 0; line < n; line++) {
+        parent[line] = line;
+        owner[line] = nobody;
     }
 
-    int index = 0, indexCorePoint = 0;
-    vector<int>::iterator iterSeeds;
-    for (iterSeeds = clusterSeeds.begin(); iterSeeds != clusterSeeds.end(); ++iterSeeds)
-    {
-        _lines.at(*iterSeeds).setId(clusterID);
-        if (_lines.at(*iterSeeds).getPoint1().pt.x == line.getPoint1().pt.x &&
-            _lines.at(*iterSeeds).getPoint1().pt.y == line.getPoint1().pt.y &&
-            _lines.at(*iterSeeds).getTheta() == line.getTheta() &&
-            _lines.at(*iterSeeds).length() == line.length())
-        {
-            indexCorePoint = index;
+    parallelFor(n, jobs, [this, &core, &parent, &owner, eps](int line) {
+        if (!core[line])
+            return;
+
+        auto reach = [&core, &parent, &owner, line](int neighbour) {
+            if (core[neighbour]) {
+                unite(parent, line, neighbour);
+                return;
+            }
+
+            int current = owner[neighbour].load();
+            while (line < current && !owner[neighbour].compare_exchange_weak(current, line)) {
+            }
+        };
+
+        /*
+         * The kept neighbours are the nearest ones: they hold the whole neighbourhood
+         * unless every one of them is within eps while some others were cut.
+         */
+        int first = _neighbourStart[line], last = _neighbourStart[line + 1];
+        bool cut = _neighbourhoodSizes[line] > last - first && _neighbourDistances[last - 1] <= eps;
+        if (cut) {
+            for (const auto& neighbour : calculateNeighbourhood(line))
+                if (neighbour.first <= eps)
+                    reach(neighbour.second);
+            return;
         }
-        ++index;
+
+        for (int k = first; k < last && _neighbourDistances[k] <= eps; k++)
+            reach(_neighbours[k]);
+    });
+
+    _labels.assign(n, NOISE);
+    vector<int> ids(n, 0);
+    int nbClusters = 0;
+    for (int line = 0; line < n; line++) {
+        int member = core[line] ? line : owner[line].load();
+        if (member == nobody)
+            continue;
+
+        int root = findRoot(parent, member);
+        if (ids[root] == 0)
+            ids[root] = ++nbClusters;
+        _labels[line] = ids[root];
     }
-    clusterSeeds.erase(clusterSeeds.begin()+indexCorePoint);
-
-    for( vector<int>::size_type i = 0, n = clusterSeeds.size(); i < n; ++i )
-    {
-        vector<int> clusterNeighors = calculateCluster(_lines.at(clusterSeeds[i]));
-
-        if ( clusterNeighors.size() >= _minPoints )
-        {
-            vector<int>::iterator iterNeighors;
-            for ( iterNeighors = clusterNeighors.begin(); iterNeighors != clusterNeighors.end(); ++iterNeighors )
-            {
-                if ( _lines.at(*iterNeighors).getId() == UNCLASSIFIED || _lines.at(*iterNeighors).getId() == NOISE )
-                {
-                    if ( _lines.at(*iterNeighors).getId() == UNCLASSIFIED )
-                    {
-                        clusterSeeds.push_back(*iterNeighors);
-                        n = clusterSeeds.size();
-                    }
-                    _lines.at(*iterNeighors).setId(clusterID);
-                }
-            }
+
+    return _labels;
+}
+
+/**
+ * Computes the eps-neighbourhood of a line, along with the distance to each neighbour.
+ *
+ * Only the lines of the grid cells overlapping the search box of the line are compared
+ * with it. Lines whose box can't be bounded are compared with every line.
+ *
+ * The cells of a column of the grid are contiguous in the feature matrix: each column is
+ * scanned by weightedCandidates, which drops the lines that are clearly too far. The
+ * remaining ones are checked with calculateDistance.
+ *
+ * @param point     The index of the line at the center of the neighbourhood.
+ *
+ * @return      The (distance, index) pairs of the neighbours of _line_, in no particular order.
+ */
+vector<pair<double, int>> DBSCAN::calculateNeighbourhood(int point) const
+{
+    const Segment& core = _lines[point];
+    vector<pair<double, int>> neighbourhood;
+
+    double coefficients[4];
+    distanceCoefficients(core, coefficients);
+
+    const float* columns[4] = { _features[0].data(), _features[1].data(), _features[2].data(), _features[3].data() };
+    float center[4] = { core.x1, core.y1, core.theta, core.length };
+    float scales[4];
+    for (int k = 0; k < 4; k++)
+        scales[k] = (float) coefficients[k];
+    float bound = (float) (_epsilon * _epsilon) * (1 + TOLERANCE);
+
+    vector<int> rows;
+    auto scan = [&](int first, int last) {
+        if ((int) rows.size() < last - first)
+            rows.resize(last - first);
+
+        int count = weightedCandidates(columns, first, last, center, scales, bound, TOLERANCE, rows.data());
+        for (int k = 0; k < count; k++) {
+            int index = _cellLines[rows[k]];
+            double distance = calculateDistance(core, _lines[index]);
+
+            if (distance <= _epsilon)
+                neighbourhood.emplace_back(distance, index);
         }
+    };
+
+    double rx, ry;
+    if (!searchBox(core, coefficients, rx, ry)) {
+        scan(0, _lines.size());
+        return neighbourhood;
     }
 
-    return SUCCESS;
+    int firstX, lastX, firstY, lastY;
+    cellRange(core.x1, rx, _minX, _cellX, _gridX, firstX, lastX);
+    cellRange(core.y1, ry, _minY, _cellY, _gridY, firstY, lastY);
+    for (int cx = firstX; cx <= lastX; cx++)
+        scan(_cellStart[cx * _gridY + firstY], _cellStart[cx * _gridY + lastY + 1]);
+
+    return neighbourhood;
 }
 
 /**
- * Computes the eps-neighbourhood of a line.
+ * Computes the coefficients of the squared distance to a core line: the squared distance
+ * to the core line is \f$\sum_k c_k \Delta_k^2\f$ over x, y, theta and length.
  *
- * @param point     The line at the center of the neighbourhood.
+ * @param core          The core line.
+ * @param coefficients  The 4 coefficients.
+ */
+void DBSCAN::distanceCoefficients(const Segment& core, double* coefficients) const
+{
+    coefficients[0] = _wx / _sizeRatio;
+    coefficients[1] = _wy / _sizeRatio;
+    coefficients[2] = _wtheta / core.theta;
+    coefficients[3] = _wl / core.length;
+}
+
+/**
+ * Computes the half-widths of a box around the start point of a line, out of which no line
+ * can be in its eps-neighbourhood.
  *
- * @return      A vector of indices representing the neighbour of _line_ in __lines_.
+ * The squared distance is a sum of four terms \f$c_k \Delta_k^2\f$, whose coefficients
+ * \f$c_k\f$ depend on the weights and on the core line. A term can't be lower than
+ * \f$L_k = \min(0, c_k \max \Delta_k^2)\f$, the largest difference being taken over
+ * all the lines. A line in the neighbourhood thus verifies, for a positive \f$c_x\f$:
+ *          \f$c_x \Delta_x^2 \leq \epsilon^2 - \sum_k L_k\f$
+ * and the same goes for y. The box is widened a little to make up for rounding errors.
+ *
+ * @param core          The line at the center of the neighbourhood.
+ * @param coefficients  The coefficients of the distance to the core line.
+ * @param rx    The half-width of the box along x, infinite if x doesn't bound the neighbourhood.
+ * @param ry    The half-width of the box along y, infinite if y doesn't bound the neighbourhood.
+ *
+ * @return  False if the distance can't be bounded, for instance if the polar angle of the
+ *          core line is 0.
+ */
+bool DBSCAN::searchBox(const Segment& core, const double* coefficients, double& rx, double& ry) const
+{
+    double spans[4] = { max(core.x1 - _minX, _maxX - core.x1),
+                        max(core.y1 - _minY, _maxY - core.y1),
+                        max(core.theta - _minTheta, _maxTheta - core.theta),
+                        max(core.length - _minLength, _maxLength - core.length) };
+
+    double budget = _epsilon * _epsilon;
+    for (int k = 0; k < 4; k++) {
+        if (!std::isfinite(coefficients[k]))
+            return false;
+        budget -= min(0.0, coefficients[k] * spans[k] * spans[k]);
+    }
+
+    const double infinity = numeric_limits<double>::infinity();
+    rx = coefficients[0] > 0 ? sqrt(budget / coefficients[0]) * (1 + 1e-6) + 1e-3 : infinity;
+    ry = coefficients[1] > 0 ? sqrt(budget / coefficients[1]) * (1 + 1e-6) + 1e-3 : infinity;
+
+    return true;
+}
+
+/**
+ * Builds the grid over the start points of the lines. Cells are as wide as the search box
+ * of a line whose other terms can't be negative, so that such a box overlaps at most 3x3
+ * cells. The total number of cells is bounded by the number of lines: when the image is
+ * too sparse for that, both axes are coarsened by the same factor.
+ *
+ * The grid is stored as a compressed array: the lines are sorted by cell with a counting
+ * sort, and each cell is a range of that array.
  */
-vector<int> DBSCAN::calculateCluster(ClusteredLine& point)
+void DBSCAN::buildGrid()
 {
-    int index = 0;
-    vector<ClusteredLine>::iterator iter;
-    vector<int> clusterIndex;
-    for (iter = _lines.begin(); iter != _lines.end(); ++iter) {
-        double distance = calculateDistance(point, *iter);
+    const int n = _lines.size();
+    const double infinity = numeric_limits<double>::infinity();
 
-        if (distance <= _epsilon)
-            clusterIndex.push_back(index);
+    _minX = _minY = _minTheta = _minLength = infinity;
+    _maxX = _maxY = _maxTheta = _maxLength = -infinity;
+    for (const auto& line : _lines) {
+        _minX = min(_minX, (double) line.x1);
+        _maxX = max(_maxX, (double) line.x1);
+        _minY = min(_minY, (double) line.y1);
+        _maxY = max(_maxY, (double) line.y1);
+        _minTheta = min(_minTheta, (double) line.theta);
+        _maxTheta = max(_maxTheta, (double) line.theta);
+        _minLength = min(_minLength, (double) line.length);
+        _maxLength = max(_maxLength, (double) line.length);
+    }
+
+    double spanX = n > 0 ? _maxX - _minX : 0;
+    double spanY = n > 0 ? _maxY - _minY : 0;
+    double radiusX = _wx > 0 ? _epsilon * sqrt(_sizeRatio / _wx) : infinity;
+    double radiusY = _wy > 0 ? _epsilon * sqrt(_sizeRatio / _wy) : infinity;
+
+    double gridX = max(1.0, min(spanX / radiusX, (double) n));
+    double gridY = max(1.0, min(spanY / radiusY, (double) n));
+    if (gridX * gridY > max(n, 1)) {
+        double scale = sqrt(max(n, 1) / (gridX * gridY));
+        gridX = max(1.0, gridX * scale);
+        gridY = max(1.0, gridY * scale);
+    }
+    _gridX = (int) gridX;
+    _gridY = (int) gridY;
+    _cellX = spanX > 0 ? spanX / _gridX : 1;
+    _cellY = spanY > 0 ? spanY / _gridY : 1;
+
+    vector<int> cells(n);
+    _cellStart.assign(_gridX * _gridY + 1, 0);
+    for (int i = 0; i < n; i++) {
+        int cx, cy, last;
+        cellRange(_lines[i].x1, 0, _minX, _cellX, _gridX, cx, last);
+        cellRange(_lines[i].y1, 0, _minY, _cellY, _gridY, cy, last);
+        cells[i] = cx * _gridY + cy;
+        _cellStart[cells[i] + 1]++;
+    }
+    for (size_t c = 1; c < _cellStart.size(); c++)
+        _cellStart[c] += _cellStart[c - 1];
 
-        index++;
+    _cellLines.resize(n);
+    vector<int> next(_cellStart.begin(), _cellStart.end() - 1);
+    for (int i = 0; i < n; i++)
+        _cellLines[next[cells[i]]++] = i;
+
+    for (auto& feature : _features)
+        feature.resize(n);
+    for (int k = 0; k < n; k++) {
+        const Segment& line = _lines[_cellLines[k]];
+        _features[0][k] = line.x1;
+        _features[1][k] = line.y1;
+        _features[2][k] = line.theta;
+        _features[3][k] = line.length;
     }
-    return clusterIndex;
 }
 
+/**
+ * Computes the cells of an axis of the grid overlapping [_center_ - _radius_, _center_ + _radius_].
+ *
+ * @param center    The center of the range.
+ * @param radius    The half-width of the range, possibly infinite.
+ * @param origin    The coordinate of the start of the first cell.
+ * @param width     The width of a cell.
+ * @param count     The number of cells along the axis.
+ * @param first     The first cell overlapping the range.
+ * @param last      The last cell overlapping the range.
+ */
+void DBSCAN::cellRange(double center, double radius, double origin, double width, int count,
+                       int& first, int& last)
+{
+    double from = (center - radius - origin) / width;
+    double to = (center + radius - origin) / width;
 
+    first = from <= 0 ? 0 : (int) min(floor(from), (double) count - 1);
+    last = to >= count - 1 ? count - 1 : (int) max(floor(to), 0.0);
+}
@@ -0,0 +1,687 @@
+/**
+ * @file    distance.cpp
+ * This file implements the functions defined
+ * in distance.hpp
+ */
+
+#include "../include/distance.hpp"
+#include "../include/G2NNCollector.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DEFALS_X86
+#include <immintrin.h>
+#endif
+
+using namespace defals;
+
+/*
+ * Every kernel splits the descriptors in blocks of 16 components and accumulates
+ * the squared difference of the l-th component of each block in the l-th partial
+ * sum. The 16 partial sums are then reduced by halves:
+ *          s[l] += s[l + 8], then s[l] += s[l + 4], then s[l] += s[l + 2], then s[0] + s[1]
+ * and the components that don't fill a block are added last, one by one.
+ *
+ * Products and sums must never be fused, otherwise the kernels having FMA instructions
+ * at hand would round differently: this file is compiled with -ffp-contract=off.
+ *
+ * The bounded kernels reduce the partial sums after each block and give up as soon as
+ * the reduced value reaches the bound. All the squared differences are non-negative and
+ * floating-point additions are monotonic, so the reduced partial sums never exceed the
+ * final result: giving up never drops a distance that would have been below the bound,
+ * and a distance below the bound is computed with the exact same operations as l2sq.
+ *
+ * Every kernel is instantiated for 64 and 128 components, the sizes of SURF descriptors,
+ * so that its loops are unrolled at compile time, and for any size known at runtime only.
+ *
+ * Each kernel also has batch drivers, compiled for the same instruction set and looping over
+ * the candidates of a query: the kernel is inlined in the loop, and only the batch goes
+ * through the dispatch table.
+ */
+
+typedef float (*Kernel)(const float *a, const float *b, int n, float bound);
+typedef void (*CollectKernel)(const float *a, const float *base, const int *rows, int count, int n,
+                              G2NNCollector &collector);
+typedef void (*BatchKernel)(const float *a, const float *base, const int *rows, int count, int n,
+                            const float *bounds, float *distances);
+
+/**
+ * The kernels of an instruction set for descriptors of a given size.
+ */
+struct KernelSet {
+    Kernel exact;
+    Kernel bounded;
+    CollectKernel collect;
+    BatchKernel batch;
+};
+
+/**
+ * Adds the squared differences of the components in [_k_, _n_[ to _sum_.
+ */
+static inline float tail(const float *a, const float *b, int k, int n, float sum) {
+    for (; k < n; k++) {
+        float d = a[k] - b[k];
+        sum += d * d;
+    }
+    return sum;
+}
+
+/**
+ * Reduces the 16 partial sums by halves.
+ */
+static inline float reduce16(const float *partial) {
+    float s[8];
+    for (int l = 0; l < 8; l++)
+        s[l] = partial[l] + partial[l + 8];
+    for (int l = 0; l < 4; l++)
+        s[l] += s[l + 4];
+    for (int l = 0; l < 2; l++)
+        s[l] += s[l + 2];
+
+    return s[0] + s[1];
+}
+
+template<int N, bool Bounded>
+__attribute__((always_inline))
+static inline float l2sqScalar(const float *a, const float *b, int n, float bound) {
+    const int dim = N > 0 ? N : n;
+    float s[16] = { 0 };
+
+    int k = 0;
+#pragma GCC unroll 8
+    for (; k + 16 <= dim; k += 16) {
+        for (int l = 0; l < 16; l++) {
+            float d = a[k + l] - b[k + l];
+            s[l] += d * d;
+        }
+
+        if (Bounded) {
+            float partial = reduce16(s);
+            if (partial >= bound)
+                return partial;
+        }
+    }
+
+    return tail(a, b, k, dim, reduce16(s));
+}
+
+template<int N>
+static void collectScalar(const float *a, const float *base, const int *rows, int count, int n,
+                             G2NNCollector &collector) {
+    for (int r = 0; r < count; r++)
+        collector.push(l2sqScalar<N, true>(a, base + (size_t) rows[r] * n, n, collector.bound()), rows[r]);
+}
+
+template<int N>
+static void batchScalar(const float *a, const float *base, const int *rows, int count, int n,
+                           const float *bounds, float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqScalar<N, true>(a, base + (size_t) rows[r] * n, n, bounds[r]);
+}
+
+#ifdef DEFALS_X86
+
+/**
+ * Reduces the partial sums [s0, s1, s2, s3] to s0 + s2 + (s1 + s3).
+ */
+__attribute__((target("sse4.1")))
+static inline float reduce4(__m128 s) {
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+template<int N, bool Bounded>
+__attribute__((target("sse4.1"), always_inline))
+static inline float l2sqSSE4(const float *a, const float *b, int n, float bound) {
+    const int dim = N > 0 ? N : n;
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    __m128 s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+
+    int k = 0;
+#pragma GCC unroll 8
+    for (; k + 16 <= dim; k += 16) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4));
+        __m128 d2 = _mm_sub_ps(_mm_loadu_ps(a + k + 8), _mm_loadu_ps(b + k + 8));
+        __m128 d3 = _mm_sub_ps(_mm_loadu_ps(a + k + 12), _mm_loadu_ps(b + k + 12));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+        s2 = _mm_add_ps(s2, _mm_mul_ps(d2, d2));
+        s3 = _mm_add_ps(s3, _mm_mul_ps(d3, d3));
+
+        if (Bounded) {
+            float partial = reduce4(_mm_add_ps(_mm_add_ps(s0, s2), _mm_add_ps(s1, s3)));
+            if (partial >= bound)
+                return partial;
+        }
+    }
+
+    return tail(a, b, k, dim, reduce4(_mm_add_ps(_mm_add_ps(s0, s2), _mm_add_ps(s1, s3))));
+}
+
+template<int N>
+__attribute__((target("sse4.1")))
+static void collectSSE4(const float *a, const float *base, const int *rows, int count, int n,
+                           G2NNCollector &collector) {
+    for (int r = 0; r < count; r++)
+        collector.push(l2sqSSE4<N, true>(a, base + (size_t) rows[r] * n, n, collector.bound()), rows[r]);
+}
+
+template<int N>
+__attribute__((target("sse4.1")))
+static void batchSSE4(const float *a, const float *base, const int *rows, int count, int n,
+                         const float *bounds, float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqSSE4<N, true>(a, base + (size_t) rows[r] * n, n, bounds[r]);
+}
+
+/**
+ * Reduces the partial sums [s0, ..., s7] and [s8, ..., s15] to a single value.
+ */
+__attribute__((target("avx2")))
+static inline float reduce16(__m256 s0, __m256 s1) {
+    __m256 s = _mm256_add_ps(s0, s1);
+    return reduce4(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+}
+
+template<int N, bool Bounded>
+__attribute__((target("avx2"), always_inline))
+static inline float l2sqAVX2(const float *a, const float *b, int n, float bound) {
+    const int dim = N > 0 ? N : n;
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+
+    int k = 0;
+#pragma GCC unroll 8
+    for (; k + 16 <= dim; k += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(b + k));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + k + 8), _mm256_loadu_ps(b + k + 8));
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(d0, d0));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(d1, d1));
+
+        if (Bounded) {
+            float partial = reduce16(s0, s1);
+            if (partial >= bound)
+                return partial;
+        }
+    }
+
+    return tail(a, b, k, dim, reduce16(s0, s1));
+}
+
+template<int N>
+__attribute__((target("avx2")))
+static void collectAVX2(const float *a, const float *base, const int *rows, int count, int n,
+                           G2NNCollector &collector) {
+    for (int r = 0; r < count; r++)
+        collector.push(l2sqAVX2<N, true>(a, base + (size_t) rows[r] * n, n, collector.bound()), rows[r]);
+}
+
+template<int N>
+__attribute__((target("avx2")))
+static void batchAVX2(const float *a, const float *base, const int *rows, int count, int n,
+                         const float *bounds, float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqAVX2<N, true>(a, base + (size_t) rows[r] * n, n, bounds[r]);
+}
+
+/**
+ * Reduces the 16 partial sums of _s0_ to a single value.
+ */
+__attribute__((target("avx512f")))
+static inline float reduce16(__m512 s0) {
+    __m128 s4 = _mm_add_ps(_mm512_extractf32x4_ps(s0, 0), _mm512_extractf32x4_ps(s0, 2));
+    __m128 s12 = _mm_add_ps(_mm512_extractf32x4_ps(s0, 1), _mm512_extractf32x4_ps(s0, 3));
+    return reduce4(_mm_add_ps(s4, s12));
+}
+
+template<int N, bool Bounded>
+__attribute__((target("avx512f"), always_inline))
+static inline float l2sqAVX512(const float *a, const float *b, int n, float bound) {
+    const int dim = N > 0 ? N : n;
+    __m512 s0 = _mm512_setzero_ps();
+
+    int k = 0;
+#pragma GCC unroll 8
+    for (; k + 16 <= dim; k += 16) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + k), _mm512_loadu_ps(b + k));
+        s0 = _mm512_add_ps(s0, _mm512_mul_ps(d0, d0));
+
+        if (Bounded) {
+            float partial = reduce16(s0);
+            if (partial >= bound)
+                return partial;
+        }
+    }
+
+    return tail(a, b, k, dim, reduce16(s0));
+}
+
+template<int N>
+__attribute__((target("avx512f")))
+static void collectAVX512(const float *a, const float *base, const int *rows, int count, int n,
+                             G2NNCollector &collector) {
+    for (int r = 0; r < count; r++)
+        collector.push(l2sqAVX512<N, true>(a, base + (size_t) rows[r] * n, n, collector.bound()), rows[r]);
+}
+
+template<int N>
+__attribute__((target("avx512f")))
+static void batchAVX512(const float *a, const float *base, const int *rows, int count, int n,
+                           const float *bounds, float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqAVX512<N, true>(a, base + (size_t) rows[r] * n, n, bounds[r]);
+}
+
+#endif
+
+/*
+ * The instruction sets of the kernels, from the narrowest to the widest, named as by l2sqKernel.
+ */
+static const char *const instructionSets[] = { "scalar", "SSE4.1", "AVX2", "AVX-512" };
+enum InstructionSet { SCALAR, SSE4, AVX2, AVX512 };
+
+/**
+ * @return  The widest instruction set the kernels may use. It is the widest one unless the
+ *          environment variable DEFALS_KERNEL names another one, which allows to compare the
+ *          kernels on the same processor. The program exits if the name is unknown.
+ */
+static InstructionSet widestAllowed() {
+    const char *name = getenv("DEFALS_KERNEL");
+    if (!name || !*name)
+        return AVX512;
+
+    for (int set = SCALAR; set <= AVX512; set++) {
+        if (strcmp(name, instructionSets[set]) == 0)
+            return (InstructionSet) set;
+    }
+    std::cerr << "Unknown DEFALS_KERNEL " << name << ", expected scalar, SSE4.1, AVX2 or AVX-512" << std::endl;
+    exit(1);
+}
+
+/**
+ * Chooses the widest kernels the processor supports, up to widestAllowed.
+ *
+ * @tparam N        The number of components of the descriptors, 0 if it's only known at runtime.
+ */
+template<int N>
+static KernelSet selectKernels(const char **name) {
+#ifdef DEFALS_X86
+    __builtin_cpu_init();
+    const InstructionSet widest = widestAllowed();
+    if (widest >= AVX512 && __builtin_cpu_supports("avx512f")) {
+        *name = instructionSets[AVX512];
+        return { l2sqAVX512<N, false>, l2sqAVX512<N, true>, collectAVX512<N>, batchAVX512<N> };
+    }
+    if (widest >= AVX2 && __builtin_cpu_supports("avx2")) {
+        *name = instructionSets[AVX2];
+        return { l2sqAVX2<N, false>, l2sqAVX2<N, true>, collectAVX2<N>, batchAVX2<N> };
+    }
+    if (widest >= SSE4 && __builtin_cpu_supports("sse4.1")) {
+        *name = instructionSets[SSE4];
+        return { l2sqSSE4<N, false>, l2sqSSE4<N, true>, collectSSE4<N>, batchSSE4<N> };
+    }
+#endif
+    *name = instructionSets[SCALAR];
+    return { l2sqScalar<N, false>, l2sqScalar<N, true>, collectScalar<N>, batchScalar<N> };
+}
+
+static const char *kernelName = nullptr;
+
+/*
+ * kernels[d]: d is 0 for any size, 1 for 64 components and 2 for 128 components.
+ */
+static const KernelSet kernels[3] = {
+        selectKernels<0>(&kernelName),
+        selectKernels<64>(&kernelName),
+        selectKernels<128>(&kernelName)
+};
+
+/**
+ * @return  The row of _kernels_ specialised for descriptors of _n_ components.
+ */
+static inline int dimension(int n) {
+    return n == 64 ? 1 : (n == 128 ? 2 : 0);
+}
+
+float defals::l2sq(const float *a, const float *b, int n) {
+    return kernels[dimension(n)].exact(a, b, n, 0);
+}
+
+float defals::l2sqBounded(const float *a, const float *b, int n, float bound) {
+    return kernels[dimension(n)].bounded(a, b, n, bound);
+}
+
+void defals::l2sqCollect(const float *a, const float *base, const int *rows, int count, int n,
+                         G2NNCollector &collector) {
+    kernels[dimension(n)].collect(a, base, rows, count, n, collector);
+}
+
+void defals::l2sqBatch(const float *a, const float *base, const int *rows, int count, int n,
+                       const float *bounds, float *distances) {
+    kernels[dimension(n)].batch(a, base, rows, count, n, bounds, distances);
+}
+
+const char *defals::l2sqKernel() {
+    return kernelName;
+}
+
+/*
+ * The kernels for compact descriptors follow the same scheme as the float ones: 16 partial
+ * sums reduced by halves, then the remaining components one by one. They're templated on the
+ * element type, half-precision or 8-bit integer, which only changes how components are widened
+ * to floats, and on the number of components. The vectorised kernels widen the components to
+ * floats and then run the exact same operations as the scalar ones.
+ */
+
+uint16_t defals::toHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+
+    // Infinities and NaNs
+    if (magnitude >= 0x7f800000)
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    // Values rounding to more than 65504, the largest half
+    if (magnitude >= 0x477ff000)
+        return sign | 0x7c00;
+    // Subnormal halves are the multiples of 2^-24: the scaling is exact and lrintf rounds to even
+    if (magnitude < 0x38800000)
+        return sign | (uint16_t) lrintf(fabsf(value) * 16777216.f);
+
+    // Rebiases the exponent from 127 to 15 and rounds the mantissa to 10 bits, to even
+    magnitude -= 112u << 23;
+    magnitude += 0xfff + ((magnitude >> 13) & 1);
+    return sign | (uint16_t) (magnitude >> 13);
+}
+
+float defals::fromHalf(uint16_t half) {
+    uint32_t sign = (uint32_t) (half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+
+    if (exponent == 0) {
+        float value = ldexpf((float) mantissa, -24);
+        return sign ? -value : value;
+    }
+
+    uint32_t bits = exponent == 0x1f ? sign | 0x7f800000 | (mantissa << 13)
+                                     : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * @return  The difference between the k-th components of _a_ and _b_, as floats.
+ */
+static inline float difference(const uint16_t *a, const uint16_t *b, const float *, int k) {
+    return fromHalf(a[k]) - fromHalf(b[k]);
+}
+
+static inline float difference(const int8_t *a, const int8_t *b, const float *scales, int k) {
+    return (float) (a[k] - b[k]) * scales[k];
+}
+
+template<class T, int N>
+__attribute__((always_inline))
+static inline float l2sqCompactScalar(const T *a, const T *b, const float *scales, int n) {
+    const int dim = N > 0 ? N : n;
+    float s[16] = { 0 };
+
+    int k = 0;
+    for (; k + 16 <= dim; k += 16) {
+        for (int l = 0; l < 16; l++) {
+            float d = difference(a, b, scales, k + l);
+            s[l] += d * d;
+        }
+    }
+
+    float sum = reduce16(s);
+    for (; k < dim; k++) {
+        float d = difference(a, b, scales, k);
+        sum += d * d;
+    }
+    return sum;
+}
+
+template<class T, int N>
+static void compactBatchScalar(const T *a, const T *base, const int *rows, int count, const float *scales, int n,
+                               float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqCompactScalar<T, N>(a, base + (size_t) rows[r] * n, scales, n);
+}
+
+#ifdef DEFALS_X86
+
+/**
+ * @return  The differences between the components [_k_, _k_ + 8[ of _a_ and _b_, as floats.
+ */
+__attribute__((target("avx2,f16c")))
+static inline __m256 differences8(const uint16_t *a, const uint16_t *b, const float *, int k) {
+    return _mm256_sub_ps(_mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (a + k))),
+                         _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (b + k))));
+}
+
+__attribute__((target("avx2,f16c")))
+static inline __m256 differences8(const int8_t *a, const int8_t *b, const float *scales, int k) {
+    __m256i d = _mm256_sub_epi32(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (a + k))),
+                                 _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *) (b + k))));
+    return _mm256_mul_ps(_mm256_cvtepi32_ps(d), _mm256_loadu_ps(scales + k));
+}
+
+template<class T, int N>
+__attribute__((target("avx2,f16c"), always_inline))
+static inline float l2sqCompactAVX2(const T *a, const T *b, const float *scales, int n) {
+    const int dim = N > 0 ? N : n;
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+
+    int k = 0;
+    for (; k + 16 <= dim; k += 16) {
+        __m256 d0 = differences8(a, b, scales, k);
+        __m256 d1 = differences8(a, b, scales, k + 8);
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(d0, d0));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(d1, d1));
+    }
+
+    float sum = reduce16(s0, s1);
+    for (; k < dim; k++) {
+        float d = difference(a, b, scales, k);
+        sum += d * d;
+    }
+    return sum;
+}
+
+template<class T, int N>
+__attribute__((target("avx2,f16c")))
+static void compactBatchAVX2(const T *a, const T *base, const int *rows, int count, const float *scales, int n,
+                             float *distances) {
+    for (int r = 0; r < count; r++)
+        distances[r] = l2sqCompactAVX2<T, N>(a, base + (size_t) rows[r] * n, scales, n);
+}
+
+#endif
+
+/**
+ * The kernels for compact descriptors of element type _T_.
+ */
+template<class T>
+struct CompactKernelSet {
+    float (*exact)(const T *a, const T *b, const float *scales, int n);
+    void (*batch)(const T *a, const T *base, const int *rows, int count, const float *scales, int n,
+                  float *distances);
+};
+
+template<class T, int N>
+static CompactKernelSet<T> selectCompactKernels() {
+#ifdef DEFALS_X86
+    __builtin_cpu_init();
+    if (widestAllowed() >= AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c"))
+        return { l2sqCompactAVX2<T, N>, compactBatchAVX2<T, N> };
+#endif
+    return { l2sqCompactScalar<T, N>, compactBatchScalar<T, N> };
+}
+
+/*
+ * compactKernels<T>[d]: same rows as _kernels_.
+ */
+template<class T>
+static const CompactKernelSet<T> compactKernels[3] = {
+        selectCompactKernels<T, 0>(),
+        selectCompactKernels<T, 64>(),
+        selectCompactKernels<T, 128>()
+};
+
+float defals::l2sqHalf(const uint16_t *a, const uint16_t *b, int n) {
+    return compactKernels<uint16_t>[dimension(n)].exact(a, b, nullptr, n);
+}
+
+float defals::l2sqInt8(const int8_t *a, const int8_t *b, const float *scales, int n) {
+    return compactKernels<int8_t>[dimension(n)].exact(a, b, scales, n);
+}
+
+template<class T>
+void defals::l2sqCompactBatch(const T *a, const T *base, const int *rows, int count, const float *scales, int n,
+                              float *distances) {
+    compactKernels<T>[dimension(n)].batch(a, base, rows, count, scales, n, distances);
+}
+
+template void defals::l2sqCompactBatch<uint16_t>(const uint16_t *, const uint16_t *, const int *, int,
+                                                 const float *, int, float *);
+template void defals::l2sqCompactBatch<int8_t>(const int8_t *, const int8_t *, const int *, int,
+                                               const float *, int, float *);
+
+/*
+ * The weighted distance kernels compute every term the same way in every lane:
+ *          d = center - feature, then term = (scale * d) * d
+ * and add the four terms in order. The vectorised kernels select the rows of a block
+ * with a comparison that is true for NaN, then the remaining rows go through the scalar code.
+ */
+
+/**
+ * @return  True unless the row at _r_ is known to be farther than _bound_ from _center_.
+ */
+static inline bool weightedCandidate(const float *const *columns, int r,
+                                     const float *center, const float *scales, float bound, float tolerance) {
+    float sum = 0, magnitude = 0;
+    for (int k = 0; k < 4; k++) {
+        float d = center[k] - columns[k][r];
+        float term = (scales[k] * d) * d;
+        sum += term;
+        magnitude += fabsf(term);
+    }
+
+    return !(sum > bound + tolerance * magnitude);
+}
+
+static int weightedCandidatesScalar(const float *const *columns, int first, int last,
+                                    const float *center, const float *scales, float bound, float tolerance,
+                                    int *rows) {
+    int count = 0;
+    for (int r = first; r < last; r++) {
+        if (weightedCandidate(columns, r, center, scales, bound, tolerance))
+            rows[count++] = r;
+    }
+    return count;
+}
+
+#ifdef DEFALS_X86
+
+__attribute__((target("avx2")))
+static int weightedCandidatesAVX2(const float *const *columns, int first, int last,
+                                  const float *center, const float *scales, float bound, float tolerance,
+                                  int *rows) {
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    const __m256 boundV = _mm256_set1_ps(bound);
+    const __m256 toleranceV = _mm256_set1_ps(tolerance);
+    __m256 centerV[4], scaleV[4];
+    for (int k = 0; k < 4; k++) {
+        centerV[k] = _mm256_set1_ps(center[k]);
+        scaleV[k] = _mm256_set1_ps(scales[k]);
+    }
+
+    int count = 0;
+    int r = first;
+    for (; r + 8 <= last; r += 8) {
+        __m256 sum = _mm256_setzero_ps();
+        __m256 magnitude = _mm256_setzero_ps();
+        for (int k = 0; k < 4; k++) {
+            __m256 d = _mm256_sub_ps(centerV[k], _mm256_loadu_ps(columns[k] + r));
+            __m256 term = _mm256_mul_ps(_mm256_mul_ps(scaleV[k], d), d);
+            sum = _mm256_add_ps(sum, term);
+            magnitude = _mm256_add_ps(magnitude, _mm256_andnot_ps(signBit, term));
+        }
+
+        __m256 threshold = _mm256_add_ps(boundV, _mm256_mul_ps(toleranceV, magnitude));
+        unsigned mask = _mm256_movemask_ps(_mm256_cmp_ps(sum, threshold, _CMP_NGT_UQ));
+        while (mask) {
+            rows[count++] = r + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+
+    return count + weightedCandidatesScalar(columns, r, last, center, scales, bound, tolerance, rows + count);
+}
+
+__attribute__((target("avx512f")))
+static int weightedCandidatesAVX512(const float *const *columns, int first, int last,
+                                    const float *center, const float *scales, float bound, float tolerance,
+                                    int *rows) {
+    const __m512 boundV = _mm512_set1_ps(bound);
+    const __m512 toleranceV = _mm512_set1_ps(tolerance);
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512 centerV[4], scaleV[4];
+    for (int k = 0; k < 4; k++) {
+        centerV[k] = _mm512_set1_ps(center[k]);
+        scaleV[k] = _mm512_set1_ps(scales[k]);
+    }
+
+    int count = 0;
+    int r = first;
+    for (; r + 16 <= last; r += 16) {
+        __m512 sum = _mm512_setzero_ps();
+        __m512 magnitude = _mm512_setzero_ps();
+        for (int k = 0; k < 4; k++) {
+            __m512 d = _mm512_sub_ps(centerV[k], _mm512_loadu_ps(columns[k] + r));
+            __m512 term = _mm512_mul_ps(_mm512_mul_ps(scaleV[k], d), d);
+            sum = _mm512_add_ps(sum, term);
+            magnitude = _mm512_add_ps(magnitude, _mm512_abs_ps(term));
+        }
+
+        __m512 threshold = _mm512_add_ps(boundV, _mm512_mul_ps(toleranceV, magnitude));
+        __mmask16 mask = _mm512_cmp_ps_mask(sum, threshold, _CMP_NGT_UQ);
+        _mm512_mask_compressstoreu_epi32(rows + count, mask, _mm512_add_epi32(_mm512_set1_epi32(r), lanes));
+        count += __builtin_popcount(mask);
+    }
+
+    return count + weightedCandidatesScalar(columns, r, last, center, scales, bound, tolerance, rows + count);
+}
+
+#endif
+
+typedef int (*WeightedKernel)(const float *const *, int, int, const float *, const float *, float, float, int *);
+
+static WeightedKernel selectWeightedKernel() {
+#ifdef DEFALS_X86
+    __builtin_cpu_init();
+    const InstructionSet widest = widestAllowed();
+    if (widest >= AVX512 && __builtin_cpu_supports("avx512f"))
+        return weightedCandidatesAVX512;
+    if (widest >= AVX2 && __builtin_cpu_supports("avx2"))
+        return weightedCandidatesAVX2;
+#endif
+    return weightedCandidatesScalar;
+}
+
+static const WeightedKernel weightedKernel = selectWeightedKernel();
+
+int defals::weightedCandidates(const float *const *columns, int first, int last,
+                               const float *center, const float *scales, float bound, float tolerance, int *rows) {
+    return weightedKernel(columns, first, last, center, scales, bound, tolerance, rows);
+}
@@ -15,13 +15,14 @@ Line::Line(InterestPoint  point1, InterestPoint point2) : _point1(move(point1)),
     _pointOrtho = ortho();
 }
 
-Line::Line(const Line& other) : Line(other._point1, other._point2)
+/**
+ * Constructs the line between the end points of a segment, to draw it
+ * or to get its other representations.
+ *
+ * @param segment   The segment.
+ */
+Line::Line(const Segment& segment) : Line(InterestPoint(segment.start()), InterestPoint(segment.end()))
 {
-    computeCartes();
-    computePolar();
-
-    _origineOrtho = Point2f(0, 0);
-    _pointOrtho = ortho();
 }
 
 double Line::distanceOrigine() const
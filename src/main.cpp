@@ -36,8 +36,25 @@ int main(int argc, char *argv[])
             "{debug d        |0     | Level of debug messages (0 to 5) }"
             "{log l          |<none>| The path to the log file }"
             "{hessian        |0     | Keypoints detection Hessian threshold }"
+            "{tile           |0     | Keypoints detection tile size in pixels (0 for a single pass) }"
+            "{tileMargin     |-1    | Overlap between keypoints detection tiles (-1 to derive it from SURF) }"
             "{angle          |4     | Fast g2NN algorithm threshold on angle value }"
             "{norm           |1.2   | Fast g2NN algorithm threshold on norm value }"
+            "{octave         |-1    | Fast g2NN algorithm threshold on octave difference, grid window only (-1 to disable) }"
+            "{separation     |0     | Fast g2NN algorithm minimal distance in pixels between compared keypoints (0 to disable) }"
+            "{budget         |0     | Fast g2NN algorithm target number of candidates per keypoint, the window's threshold is tuned to meet it (0 to disable) }"
+            "{cap            |0     | Fast g2NN algorithm maximal number of candidates per keypoint, closest by angle first (0 to disable) }"
+            "{window         |angle | Fast g2NN algorithm window: angle, norm or grid }"
+            "{batch          |0     | Number of keypoints matched together by a blocked product (0 to disable) }"
+            "{symmetric      |      | Computes the distance of each pair of keypoints once, angle window only }"
+            "{ann            |      | Fast g2NN algorithm candidates found by an approximate nearest neighbours index }"
+            "{annTrees       |4     | Number of randomized kd-trees of the approximate index }"
+            "{annChecks      |64    | Number of leaves checked by an approximate query: higher is slower but closer to exact }"
+            "{annRecall      |      | Reports the recall of approximate matching against exact matching, at most 16 candidates are scored per keypoint so recall is capped whatever annChecks }"
+            "{spill          |<none>| Directory of a temporary file holding the descriptors, for images that don't fit in memory }"
+            "{storage        |float | Descriptors scanned by the matching windows: float, half or int8, candidates are scored again in float }"
+            "{pca            |0     | Number of PCA components of the descriptors ruling out candidates before their full distance is computed, 8 to 16 is a good start (0 to disable) }"
+            "{pcaFile        |<none>| PCA of the descriptors to use instead of learning one on the image, as written by cv::PCA::write }"
             "{length         |50    | Minimum length of line segments }"
             "{minPts         |10    | DBSCAN minimal number of other segments in cluster }"
             "{epsilon        |0.5   | DBSCAN size of ball considered around each segment }"
@@ -52,6 +69,7 @@ int main(int argc, char *argv[])
             "{expansion e    |      | Exports pictures representing step by step expansion }"
             "{before_expansion be    |      | Computes binary mask before expansion }"
             "{jobs j         |      | Number of simultaneous jobs }"
+            "{workers        |0     | Number of worker processes matching shards of the keypoints, each with --jobs threads (0 to match in this process) }"
     ;
 
     CommandLineParser parser(argc, argv, keys);
@@ -74,8 +92,35 @@ int main(int argc, char *argv[])
     }
 
     auto hessian = parser.get<int>("hessian");
+    auto tile = parser.get<int>("tile");
+    auto tileMargin = parser.get<int>("tileMargin");
     auto angle = parser.get<double>("angle");
     auto norm = parser.get<double>("norm");
+    auto octave = parser.get<int>("octave");
+    auto separation = parser.get<double>("separation");
+    auto budget = parser.get<int>("budget");
+    auto cap = parser.get<int>("cap");
+    auto windowName = parser.get<string>("window");
+    auto batch = parser.get<int>("batch");
+    auto symmetric = parser.has("symmetric");
+    auto ann = parser.has("ann");
+    auto annTrees = parser.get<int>("annTrees");
+    auto annChecks = parser.get<int>("annChecks");
+    auto annRecall = parser.has("annRecall");
+
+    string spill;
+    if (parser.has("spill")) {
+        spill = parser.get<string>("spill");
+    }
+
+    auto storageName = parser.get<string>("storage");
+    auto pca = parser.get<int>("pca");
+
+    string pcaFile;
+    if (parser.has("pcaFile")) {
+        pcaFile = parser.get<string>("pcaFile");
+    }
+
     auto length = parser.get<double>("length");
     auto minPts = parser.get<int>("minPts");
     auto epsilon = parser.get<double>("epsilon");
@@ -97,12 +142,40 @@ int main(int argc, char *argv[])
         jobs = parser.get<int>("jobs");
     }
 
+    auto workers = parser.get<int>("workers");
+
     if (!parser.check()) {
         parser.printMessage();
         parser.printErrors();
         return -1;
     }
 
+    MatchingWindow window;
+    if (windowName == "angle")
+        window = MatchingWindow::ANGLE;
+    else if (windowName == "norm")
+        window = MatchingWindow::NORM;
+    else if (windowName == "grid")
+        window = MatchingWindow::GRID;
+    else {
+        cerr << "Unknown matching window: " << windowName << endl;
+        parser.printMessage();
+        return -1;
+    }
+
+    DescriptorStorage storage;
+    if (storageName == "float")
+        storage = DescriptorStorage::FLOAT;
+    else if (storageName == "half")
+        storage = DescriptorStorage::HALF;
+    else if (storageName == "int8")
+        storage = DescriptorStorage::INT8;
+    else {
+        cerr << "Unknown descriptor storage: " << storageName << endl;
+        parser.printMessage();
+        return -1;
+    }
+
     init_logger(level, logfile);
 
     int lastIndex = image.find_last_of('.');
@@ -116,8 +189,25 @@ int main(int argc, char *argv[])
                                extension,
                                mask,
                                hessian,
+                               tile,
+                               tileMargin,
                                angle,
                                norm,
+                               octave,
+                               separation,
+                               budget,
+                               cap,
+                               window,
+                               batch,
+                               symmetric,
+                               ann,
+                               annTrees,
+                               annChecks,
+                               annRecall,
+                               spill,
+                               storage,
+                               pca,
+                               pcaFile,
                                length,
                                minPts,
                                epsilon,
@@ -131,7 +221,8 @@ int main(int argc, char *argv[])
                                hulls,
                                expansion,
                                before_expansion,
-                               jobs};
+                               jobs,
+                               workers};
 
     defals::copyMoveDetector detector(options);
     detector.detect();
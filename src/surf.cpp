@@ -5,6 +5,7 @@
  */
 
 #include "../include/surf.hpp"
+#include "../include/distance.hpp"
 
 using namespace std;
 using namespace cv;
@@ -62,13 +63,13 @@ using namespace xfeatures2d;
      */
     map<double, int> distances;
 
-    Mat descriptor = descriptors.row(i);
+    const float *descriptor = descriptors.ptr<float>(i);
     
     for (int j = 0; j < keypoints.size(); j++) {
         if (i != j) {
-            Mat other = descriptors.row(j);
+            const float *other = descriptors.ptr<float>(j);
 
-            double distance = norm(descriptor, other, NORM_L2);
+            double distance = sqrt(defals::l2sq(descriptor, other, descriptors.cols));
 
             distances.insert({ distance, j });
         }
@@ -0,0 +1,79 @@
+/**
+ * @file    annTest.cpp
+ * Checks that the candidates found through the approximate nearest neighbours
+ * index don't depend on the number of threads querying it.
+ */
+
+#include "testing.hpp"
+#include "../include/InterestPoints.hpp"
+
+#include <thread>
+
+using namespace std;
+using namespace cv;
+using namespace defals;
+
+int main() {
+    mt19937 random(11);
+    uniform_real_distribution<float> coordinate(0, 1000), angle(0, 360);
+    normal_distribution<float> noise(0, 0.01f);
+    const int count = 1000, n = 64, checks = 32;
+    int failures = 0;
+
+    /*
+     * Every fifth keypoint is a noisy copy of the previous one, so that some keypoints pass the ratio test.
+     */
+    vector<float> values = randomDescriptors(count, n, random);
+    Mat descriptors(count, n, CV_32F);
+    vector<KeyPoint> keypoints;
+    for (int i = 0; i < count; i++) {
+        float *row = descriptors.ptr<float>(i);
+        for (int k = 0; k < n; k++)
+            row[k] = i % 5 == 0 && i > 0 ? descriptors.ptr<float>(i - 1)[k] + noise(random) : values[(size_t) i * n + k];
+
+        keypoints.emplace_back(Point2f(coordinate(random), coordinate(random)), 10.f, angle(random), 1.f, 0);
+    }
+
+    InterestPoints points(keypoints, descriptors, 30, 1e9);
+    points.buildIndex(4);
+
+    vector<G2NNCollector> expected(count);
+    for (int i = 0; i < count; i++)
+        points.similarityIndex(i, expected[i], MatchingWindow::ANGLE, checks);
+
+    int matched = 0;
+    for (const auto& candidates : expected)
+        matched += candidates.nbMatches() > 0;
+    if (matched == 0) {
+        cerr << "No keypoint passed the ratio test, the test proves nothing" << endl;
+        failures++;
+    }
+
+    for (int jobs : { 2, 8 }) {
+        vector<G2NNCollector> candidates(count);
+        vector<thread> threads;
+        for (int t = 0; t < jobs; t++) {
+            threads.emplace_back([&, t]() {
+                for (int i = t; i < count; i += jobs)
+                    points.similarityIndex(i, candidates[i], MatchingWindow::ANGLE, checks);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+
+        for (int i = 0; i < count; i++) {
+            bool same = expected[i].size() == candidates[i].size();
+            for (int k = 0; same && k < expected[i].size(); k++)
+                same = expected[i].index(k) == candidates[i].index(k) &&
+                       expected[i].distance(k) == candidates[i].distance(k);
+
+            if (!same) {
+                cerr << "On " << jobs << " threads, the candidates of keypoint " << i << " differ, with "
+                     << candidates[i].nbMatches() << " matches instead of " << expected[i].nbMatches() << endl;
+                failures++;
+            }
+        }
+    }
+
+    return failures > 0;
+}
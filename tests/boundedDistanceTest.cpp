@@ -0,0 +1,117 @@
+/**
+ * @file    boundedDistanceTest.cpp
+ * Checks that the bounded distance kernels, and the batch drivers feeding a
+ * G2NNCollector, give the same g2NN candidates as exact distances.
+ */
+
+#include "testing.hpp"
+#include "../include/G2NNCollector.hpp"
+
+using namespace std;
+using namespace defals;
+
+/**
+ * @return  The number of differences between the candidates of two collectors.
+ */
+static int compare(const G2NNCollector& expected, const G2NNCollector& actual, const char *name) {
+    int failures = 0;
+    if (expected.size() != actual.size() || expected.nbMatches() != actual.nbMatches())
+        failures++;
+    for (int k = 0; k < min(expected.size(), actual.size()); k++) {
+        if (expected.index(k) != actual.index(k) || expected.distance(k) != actual.distance(k))
+            failures++;
+    }
+
+    if (failures > 0)
+        cerr << name << ": " << actual.size() << " candidates and " << actual.nbMatches() << " matches instead of "
+             << expected.size() << " candidates and " << expected.nbMatches() << " matches" << endl;
+    return failures;
+}
+
+int main() {
+    if (!runsRequestedKernel())
+        return SKIPPED;
+
+    mt19937 random(12);
+    int failures = 0;
+    cerr << setprecision(9);
+
+    for (int n : { 64, 128, 37 }) {
+        const int count = 600;
+        vector<float> descriptors = randomDescriptors(count, n, random);
+
+        /*
+         * Every fifth descriptor is a noisy copy of the previous one, so that
+         * some keypoints pass the ratio test.
+         */
+        normal_distribution<float> noise(0, 0.01f);
+        for (int i = 5; i < count; i += 5) {
+            for (int k = 0; k < n; k++)
+                descriptors[(size_t) i * n + k] = descriptors[(size_t) (i - 1) * n + k] + noise(random);
+        }
+
+        vector<int> rows(count);
+        for (int r = 0; r < count; r++)
+            rows[r] = (r * 7) % count;
+
+        int matched = 0;
+        for (int i = 0; i < count; i += 3) {
+            const float *a = &descriptors[(size_t) i * n];
+
+            G2NNCollector exact, bounded, collected;
+            for (int j : rows) {
+                if (j == i)
+                    continue;
+                const float *b = &descriptors[(size_t) j * n];
+                exact.push(l2sq(a, b, n), j);
+
+                float distance = l2sqBounded(a, b, n, bounded.bound());
+                float full = l2sq(a, b, n);
+                if (distance < bounded.bound() ? distance != full : distance > full) {
+                    cerr << "l2sqBounded of " << n << " components: " << distance << " for " << full
+                         << " bounded by " << bounded.bound() << endl;
+                    failures++;
+                }
+                bounded.push(distance, j);
+            }
+
+            vector<int> others;
+            for (int j : rows) {
+                if (j != i)
+                    others.push_back(j);
+            }
+            for (size_t first = 0; first < others.size(); first += 64) {
+                int block = min<int>(64, others.size() - first);
+                l2sqCollect(a, descriptors.data(), others.data() + first, block, n, collected);
+            }
+
+            failures += compare(exact, bounded, "l2sqBounded");
+            failures += compare(exact, collected, "l2sqCollect");
+            matched += exact.nbMatches() > 0;
+
+            /*
+             * Each distance of a batch has its own bound: it must be exact below it,
+             * and between the bound and the exact distance above it.
+             */
+            vector<float> bounds(others.size()), distances(others.size());
+            for (size_t r = 0; r < others.size(); r++)
+                bounds[r] = r % 4 == 0 ? numeric_limits<float>::infinity() : 0.1f * (r % 7);
+            l2sqBatch(a, descriptors.data(), others.data(), others.size(), n, bounds.data(), distances.data());
+            for (size_t r = 0; r < others.size(); r++) {
+                float full = l2sq(a, &descriptors[(size_t) others[r] * n], n);
+                if (full < bounds[r] ? distances[r] != full : distances[r] < bounds[r] || distances[r] > full) {
+                    cerr << "l2sqBatch of " << n << " components: " << distances[r] << " for " << full
+                         << " bounded by " << bounds[r] << endl;
+                    failures++;
+                }
+            }
+        }
+
+        if (matched == 0) {
+            cerr << "No keypoint of " << n << " components passed the ratio test, the test proves nothing" << endl;
+            failures++;
+        }
+    }
+
+    return failures > 0;
+}
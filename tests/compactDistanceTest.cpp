@@ -0,0 +1,85 @@
+/**
+ * @file    compactDistanceTest.cpp
+ * Checks that the kernels of half-precision and 8-bit descriptors return the same
+ * bits as the documented summation order over the floats they stand for.
+ */
+
+#include "testing.hpp"
+
+using namespace std;
+using namespace defals;
+
+int main() {
+    if (!runsRequestedKernel())
+        return SKIPPED;
+
+    mt19937 random(19);
+    int failures = 0;
+    cerr << setprecision(9);
+
+    for (int n : { 64, 128, 37 }) {
+        const int count = 300;
+        vector<float> descriptors = randomDescriptors(count, n, random);
+
+        vector<uint16_t> halves(descriptors.size());
+        for (size_t k = 0; k < descriptors.size(); k++)
+            halves[k] = toHalf(descriptors[k]);
+
+        uniform_int_distribution<int> integer(-127, 127);
+        uniform_real_distribution<float> scale(1e-4f, 1e-2f);
+        vector<int8_t> integers(descriptors.size());
+        for (auto& value : integers)
+            value = integer(random);
+        vector<float> scales(n);
+        for (auto& value : scales)
+            value = scale(random);
+
+        vector<int> rows(count);
+        for (int r = 0; r < count; r++)
+            rows[r] = (r * 11) % count;
+
+        vector<float> halfDistances(count), int8Distances(count);
+        for (int i = 0; i < count; i += 5) {
+            const uint16_t *halfA = &halves[(size_t) i * n];
+            const int8_t *int8A = &integers[(size_t) i * n];
+            l2sqCompactBatch(halfA, halves.data(), rows.data(), count, scales.data(), n, halfDistances.data());
+            l2sqCompactBatch(int8A, integers.data(), rows.data(), count, scales.data(), n, int8Distances.data());
+
+            for (int r = 0; r < count; r++) {
+                const uint16_t *halfB = &halves[(size_t) rows[r] * n];
+                const int8_t *int8B = &integers[(size_t) rows[r] * n];
+
+                float expected = referenceSum([&](int k) { return fromHalf(halfA[k]) - fromHalf(halfB[k]); }, n);
+                float distance = l2sqHalf(halfA, halfB, n);
+                if (distance != expected || halfDistances[r] != expected) {
+                    cerr << "Half-precision distance of " << n << " components: " << distance << " and "
+                         << halfDistances[r] << " in batch instead of " << expected << endl;
+                    failures++;
+                }
+
+                expected = referenceSum([&](int k) { return (float) (int8A[k] - int8B[k]) * scales[k]; }, n);
+                distance = l2sqInt8(int8A, int8B, scales.data(), n);
+                if (distance != expected || int8Distances[r] != expected) {
+                    cerr << "8-bit distance of " << n << " components: " << distance << " and "
+                         << int8Distances[r] << " in batch instead of " << expected << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    /*
+     * The conversion to half-precision must round to the nearest, ties to even.
+     */
+    for (float value : { 1.f, -2.5f, 65504.f, 65520.f, 1e-8f, 3e-5f, 0.1f }) {
+        float half = fromHalf(toHalf(value));
+        float next = fromHalf(toHalf(value) + 1);
+        float previous = fromHalf(toHalf(value) - 1);
+        if (isfinite(half) && (abs(half - value) > abs(next - value) || abs(half - value) > abs(previous - value))) {
+            cerr << value << " is converted to the half-precision float " << half << endl;
+            failures++;
+        }
+    }
+
+    return failures > 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * @file    dbscanTest.cpp
+ * Checks that the clusters DBSCAN extracts from its grid and its neighbourhood graph
+ * are the ones of a brute-force scan comparing every pair of lines.
+ */
+
+#include "testing.hpp"
+#include "../include/dbscan.hpp"
+
+#include <functional>
+#include <limits>
+#include <numeric>
+
+using namespace std;
+using namespace defals;
+
+/**
+ * Runs DBSCAN by comparing every pair of lines. Clusters are numbered as by DBSCAN::extract:
+ * core lines reaching each other in either direction are merged, a border line goes to the
+ * cluster of the lowest core line reaching it, and clusters are numbered from 1 by their
+ * lowest line.
+ *
+ * @param distances     The distance from each line to each line, as given by DBSCAN::calculateDistance.
+ *
+ * @return  The ID of the cluster of each line, NOISE for the outliers.
+ */
+static vector<int> bruteForce(const vector<vector<double>>& distances, unsigned int minPts, double eps) {
+    const int n = distances.size();
+
+    vector<vector<int>> neighbourhoods(n);
+    vector<bool> core(n);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (distances[i][j] <= eps)
+                neighbourhoods[i].push_back(j);
+        }
+        core[i] = neighbourhoods[i].size() >= minPts;
+    }
+
+    vector<int> parents(n);
+    iota(parents.begin(), parents.end(), 0);
+    function<int(int)> root = [&](int line) {
+        return parents[line] == line ? line : parents[line] = root(parents[line]);
+    };
+
+    vector<int> owners(n, numeric_limits<int>::max());
+    for (int i = 0; i < n; i++) {
+        if (!core[i])
+            continue;
+        for (int j : neighbourhoods[i]) {
+            if (core[j]) {
+                int a = root(i), b = root(j);
+                parents[max(a, b)] = min(a, b);
+            }
+            else
+                owners[j] = min(owners[j], i);
+        }
+    }
+
+    vector<int> labels(n, NOISE), ids(n, 0);
+    int clusters = 0;
+    for (int i = 0; i < n; i++) {
+        int owner = core[i] ? i : owners[i];
+        if (owner == numeric_limits<int>::max())
+            continue;
+        int cluster = root(owner);
+        if (ids[cluster] == 0)
+            ids[cluster] = ++clusters;
+        labels[i] = ids[cluster];
+    }
+    return labels;
+}
+
+int main() {
+    mt19937 random(22);
+    int failures = 0;
+
+    for (int trial = 0; trial < 8; trial++) {
+        const int width = 800 + random() % 400, height = 600 + random() % 300;
+        const int n = 200 + random() % 500;
+        uniform_real_distribution<float> x(0, width), y(0, height);
+        normal_distribution<float> noise(0, 5 + trial % 10);
+
+        /*
+         * Clusters of nearly parallel lines, points and short horizontal lines, then random lines.
+         */
+        vector<Segment> lines;
+        const int nbClusters = 3 + random() % 5;
+        for (int c = 0; c < nbClusters; c++) {
+            float x0 = x(random), y0 = y(random);
+            float dx = x(random) - x0, dy = y(random) - y0;
+            for (int k = 0; k < n / (2 * nbClusters); k++) {
+                cv::Point2f start(x0 + noise(random), y0 + noise(random));
+                cv::Point2f end(x0 + dx + noise(random), y0 + dy + noise(random));
+                lines.push_back(Segment::between(start, end));
+            }
+        }
+        for (int k = 0; k < 20; k++) {
+            cv::Point2f point(x(random), y(random));
+            lines.push_back(Segment::between(point, point));
+            lines.push_back(Segment::between(point, cv::Point2f(point.x + 30, point.y)));
+        }
+        while ((int) lines.size() < n)
+            lines.push_back(Segment::between(cv::Point2f(x(random), y(random)), cv::Point2f(x(random), y(random))));
+
+        double wx = 0.25, wy = 0.25, wtheta = 0.25;
+        if (trial % 4 == 1)
+            wx = 0.4, wy = 0.1, wtheta = 0.6;
+        else if (trial % 4 == 2)
+            wx = 0, wy = 0.5, wtheta = 0.1;
+        const double eps = 0.3 + 0.1 * (trial % 5);
+        const unsigned int minPts = 2 + trial % 8;
+
+        DBSCAN scanner(minPts, eps, lines, height, width, wx, wy, wtheta);
+        scanner.computeNeighbourhoods(4);
+
+        vector<vector<double>> distances(lines.size(), vector<double>(lines.size()));
+        for (size_t i = 0; i < lines.size(); i++) {
+            for (size_t j = 0; j < lines.size(); j++)
+                distances[i][j] = scanner.calculateDistance(lines[i], lines[j]);
+        }
+
+        /*
+         * Smaller parameters are read from the graph, larger minPts need region queries again.
+         */
+        vector<pair<unsigned int, double>> parameters;
+        for (unsigned int points = minPts; points >= 1; points /= 2) {
+            for (double radius : { eps, eps * 0.7, eps * 0.4 })
+                parameters.emplace_back(points, radius);
+        }
+        parameters.emplace_back(minPts * 2, eps);
+        parameters.emplace_back(minPts + 3, eps);
+
+        for (const auto& parameter : parameters) {
+            vector<int> expected = bruteForce(distances, parameter.first, parameter.second);
+            for (int jobs : { 1, 4 }) {
+                if (scanner.extract(parameter.first, parameter.second, jobs) != expected) {
+                    cerr << "Trial " << trial << ": the clusters for minPts = " << parameter.first << " and eps = "
+                         << parameter.second << " on " << jobs << " threads differ from the brute force" << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures > 0;
+}
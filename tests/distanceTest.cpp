@@ -0,0 +1,45 @@
+/**
+ * @file    distanceTest.cpp
+ * Checks that l2sq returns the same bits as the documented summation order,
+ * whatever the instruction set of the kernel.
+ */
+
+#include "testing.hpp"
+
+using namespace std;
+using namespace defals;
+
+int main() {
+    if (!runsRequestedKernel())
+        return SKIPPED;
+
+    mt19937 random(5);
+    int failures = 0;
+    cerr << setprecision(9);
+
+    /*
+     * The sizes of SURF descriptors have their own kernels, the other ones
+     * go through the generic kernels and their tails.
+     */
+    for (int n : { 64, 128, 16, 20, 37, 72, 100 }) {
+        const int count = 200;
+        vector<float> descriptors = randomDescriptors(count + 1, n, random);
+
+        for (int i = 0; i < count; i++) {
+            for (int j = 0; j < count; j += 7) {
+                const float *a = &descriptors[(size_t) i * n];
+                // Shifted by a component, to load unaligned descriptors too
+                const float *b = &descriptors[(size_t) j * n + (j % 2)];
+
+                float expected = referenceSum([&](int k) { return a[k] - b[k]; }, n);
+                float distance = l2sq(a, b, n);
+                if (memcmp(&distance, &expected, sizeof(float)) != 0) {
+                    cerr << "l2sq of " << n << " components: " << distance << " instead of " << expected << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures > 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file    prefilterTest.cpp
+ * Checks that ruling out candidates from compact descriptors or from projections on
+ * principal components doesn't change the g2NN candidates of any keypoint: the bounds
+ * of the compact and projected distances are exact.
+ */
+
+#include "testing.hpp"
+#include "../include/InterestPoints.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace defals;
+
+/**
+ * @return  Keypoints spread over an image and around the circle, with SURF-like descriptors
+ *          whose variance decreases along the components, so that the first principal
+ *          components hold most of it. Every fifth keypoint is a noisy copy of the previous
+ *          one, moved away from it, so that some keypoints pass the ratio test.
+ */
+static InterestPoints randomInterestPoints(int count, int n, mt19937& random) {
+    uniform_real_distribution<float> coordinate(0, 1000), angle(0, 360);
+    normal_distribution<float> noise(0, 0.01f);
+
+    vector<float> values = randomDescriptors(count, n, random);
+    Mat descriptors(count, n, CV_32F);
+    vector<KeyPoint> keypoints;
+    for (int i = 0; i < count; i++) {
+        float *row = descriptors.ptr<float>(i);
+        for (int k = 0; k < n; k++)
+            row[k] = i % 5 == 0 && i > 0 ? descriptors.ptr<float>(i - 1)[k] + noise(random)
+                                         : values[(size_t) i * n + k] * pow(0.9f, k);
+
+        keypoints.emplace_back(Point2f(coordinate(random), coordinate(random)), 10.f, angle(random), 1.f, 0);
+    }
+
+    return InterestPoints(keypoints, descriptors, 360, 1e9);
+}
+
+/**
+ * @return  The candidates of every keypoint against all the other ones.
+ */
+static vector<G2NNCollector> allCandidates(const InterestPoints& points) {
+    vector<G2NNCollector> candidates(points.size());
+    for (int i = 0; i < points.size(); i++)
+        points.similarityAngle(i, candidates[i]);
+    return candidates;
+}
+
+/**
+ * @return  The number of keypoints whose candidates differ from the expected ones.
+ */
+static int compare(const vector<G2NNCollector>& expected, const vector<G2NNCollector>& actual, const char *name) {
+    int failures = 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        bool same = expected[i].size() == actual[i].size();
+        for (int k = 0; same && k < expected[i].size(); k++)
+            same = expected[i].index(k) == actual[i].index(k) && expected[i].distance(k) == actual[i].distance(k);
+
+        if (!same) {
+            cerr << name << ": the candidates of keypoint " << i << " differ, with " << actual[i].nbMatches()
+                 << " matches instead of " << expected[i].nbMatches() << endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+int main() {
+    if (!runsRequestedKernel())
+        return SKIPPED;
+
+    mt19937 random(20);
+    int failures = 0;
+
+    for (int n : { 64, 128 }) {
+        InterestPoints points = randomInterestPoints(800, n, random);
+
+        points.buildCompactDescriptors(DescriptorStorage::FLOAT);
+        vector<G2NNCollector> expected = allCandidates(points);
+
+        int matched = 0;
+        for (const auto& candidates : expected)
+            matched += candidates.nbMatches() > 0;
+        if (matched == 0) {
+            cerr << "No keypoint of " << n << " components passed the ratio test, the test proves nothing" << endl;
+            failures++;
+        }
+
+        for (auto storage : { DescriptorStorage::HALF, DescriptorStorage::INT8 }) {
+            const char *name = storage == DescriptorStorage::HALF ? "Half-precision descriptors" : "8-bit descriptors";
+
+            points.buildCompactDescriptors(storage);
+            InterestPoints::resetAvoidedDistances();
+            failures += compare(expected, allCandidates(points), name);
+            if (InterestPoints::avoidedDistances() == 0) {
+                cerr << name << " of " << n << " components never ruled out a candidate, the test proves nothing" << endl;
+                failures++;
+            }
+        }
+
+        /*
+         * The projections rule out candidates before the compact descriptors, alone or with them.
+         */
+        for (int dimensions : { 8, 16 }) {
+            for (auto storage : { DescriptorStorage::FLOAT, DescriptorStorage::HALF }) {
+                string name = "Projection on " + to_string(dimensions) + " components" +
+                              (storage == DescriptorStorage::HALF ? " and half-precision descriptors" : "");
+
+                points.buildCompactDescriptors(storage);
+                points.learnProjection(dimensions);
+                InterestPoints::resetAvoidedDistances();
+                failures += compare(expected, allCandidates(points), name.c_str());
+                if (points.projectionSize() != dimensions || InterestPoints::avoidedDistances() == 0) {
+                    cerr << name << " of " << n << " components never ruled out a candidate, the test proves nothing" << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures > 0;
+}
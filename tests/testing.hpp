@@ -0,0 +1,89 @@
+/**
+ * @file    testing.hpp
+ * This file defines the helpers shared by the tests. Each test is a program
+ * returning 0 when it passes, SKIPPED when it can't run on this machine, and
+ * 1 otherwise, after printing the failed checks.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../include/distance.hpp"
+
+/**  The exit code telling ctest that a test was skipped  */
+static const int SKIPPED = 77;
+
+/**
+ * The tests of the distance kernels are run once for each instruction set, named by
+ * the environment variable DEFALS_KERNEL.
+ *
+ * @return  False if the processor doesn't support the instruction set the test was run for.
+ */
+inline bool runsRequestedKernel() {
+    const char *requested = getenv("DEFALS_KERNEL");
+    if (requested && *requested && strcmp(requested, defals::l2sqKernel()) != 0) {
+        std::cout << "The processor doesn't support " << requested << ", the test is skipped" << std::endl;
+        return false;
+    }
+
+    std::cout << "Testing the " << defals::l2sqKernel() << " kernels" << std::endl;
+    return true;
+}
+
+/**
+ * @param count     The number of descriptors.
+ * @param n         The number of components of the descriptors.
+ * @param random    The generator of the components.
+ *
+ * @return  _count_ descriptors of _n_ components stored row after row, whose components
+ *          are spread like the ones of SURF descriptors.
+ */
+inline std::vector<float> randomDescriptors(int count, int n, std::mt19937 &random) {
+    std::normal_distribution<float> component(0, 0.1f);
+
+    std::vector<float> descriptors((size_t) count * n);
+    for (auto& value : descriptors)
+        value = component(random);
+    return descriptors;
+}
+
+/**
+ * Sums squared differences the way the kernels are documented to, in 16 partial sums
+ * reduced by halves, then the components that don't fill a block one by one.
+ *
+ * @param difference    The difference between the k-th components, as a float.
+ * @param n             The number of components.
+ *
+ * @return  The sum of the squared differences.
+ */
+template<class Difference>
+float referenceSum(Difference difference, int n) {
+    float s[16] = { 0 };
+    int k = 0;
+    for (; k + 16 <= n; k += 16) {
+        for (int l = 0; l < 16; l++) {
+            float d = difference(k + l);
+            s[l] += d * d;
+        }
+    }
+
+    for (int l = 0; l < 8; l++)
+        s[l] += s[l + 8];
+    for (int l = 0; l < 4; l++)
+        s[l] += s[l + 4];
+    for (int l = 0; l < 2; l++)
+        s[l] += s[l + 2];
+
+    float sum = s[0] + s[1];
+    for (; k < n; k++) {
+        float d = difference(k);
+        sum += d * d;
+    }
+    return sum;
+}
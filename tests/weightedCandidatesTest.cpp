@@ -0,0 +1,100 @@
+/**
+ * @file    weightedCandidatesTest.cpp
+ * Checks that weightedCandidates selects the same rows whatever the instruction set,
+ * and never drops a row within the bound.
+ */
+
+#include "testing.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+using namespace defals;
+
+/**
+ * The rule documented by weightedCandidates, computed row by row.
+ *
+ * @return  True if the r-th row may be within _bound_ of _center_.
+ */
+static bool mayBeWithin(const vector<float> *columns, int r, const float *center, const float *scales,
+                        float bound, float tolerance) {
+    float sum = 0, magnitude = 0;
+    for (int k = 0; k < 4; k++) {
+        float d = center[k] - columns[k][r];
+        float term = (scales[k] * d) * d;
+        sum += term;
+        magnitude += fabsf(term);
+    }
+    return !(sum > bound + tolerance * magnitude);
+}
+
+int main() {
+    if (!runsRequestedKernel())
+        return SKIPPED;
+
+    mt19937 random(25);
+    uniform_real_distribution<float> feature(-100, 100);
+    const float tolerance = 1e-5f;
+    int failures = 0;
+
+    for (int test = 0; test < 2000; test++) {
+        const int n = 1 + random() % 300;
+        vector<float> columns[4];
+        for (auto& column : columns) {
+            column.resize(n);
+            for (auto& value : column)
+                value = feature(random);
+        }
+
+        float center[4], scales[4];
+        for (int k = 0; k < 4; k++) {
+            center[k] = feature(random);
+            scales[k] = fabsf(feature(random)) * 1e-3f;
+        }
+
+        /*
+         * Rows on the center, negative weights, infinite and undefined weights.
+         */
+        if (test % 7 == 0)
+            columns[2][random() % n] = center[2];
+        if (test % 3 == 1)
+            scales[3] = -scales[3];
+        if (test % 11 == 0)
+            scales[2] = numeric_limits<float>::infinity();
+        if (test % 13 == 0)
+            scales[1] = nanf("");
+        float bound = fabsf(feature(random)) * 5;
+
+        // Bounds that aren't multiples of the width of the vectors
+        int first = random() % n;
+        int last = first + random() % (n - first + 1);
+
+        const float *pointers[4] = { columns[0].data(), columns[1].data(), columns[2].data(), columns[3].data() };
+        vector<int> rows(n);
+        int count = weightedCandidates(pointers, first, last, center, scales, bound, tolerance, rows.data());
+        rows.resize(count);
+
+        vector<int> expected;
+        for (int r = first; r < last; r++) {
+            if (mayBeWithin(columns, r, center, scales, bound, tolerance))
+                expected.push_back(r);
+
+            double distance = 0;
+            for (int k = 0; k < 4; k++)
+                distance += (double) scales[k] * ((double) center[k] - columns[k][r]) * ((double) center[k] - columns[k][r]);
+            if (distance <= bound && !binary_search(rows.begin(), rows.end(), r)) {
+                cerr << "Row " << r << " at " << distance << " within " << bound << " was dropped" << endl;
+                failures++;
+            }
+        }
+
+        if (rows != expected) {
+            cerr << "Test " << test << ": " << rows.size() << " rows selected instead of " << expected.size() << endl;
+            failures++;
+        }
+    }
+
+    return failures > 0;
+}